@@ -0,0 +1,57 @@
+#ifndef CARTHUSIAN_BENCH_H
+#define CARTHUSIAN_BENCH_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+#include <wayland-server-core.h>
+
+/*
+ * Stand-in for the remote compositor the panel is nested in. It implements
+ * just enough of wl_compositor, wl_subcompositor, wl_shm, wl_seat, wl_output,
+ * xdg_wm_base, wp_presentation and zwlr_layer_shell_v1 for the panel to run
+ * headless. Buffers are released as soon as they are committed and frame
+ * callbacks and presentation feedback fire on a fixed refresh timer, as if
+ * every commit was copied and scanned out on the next vblank.
+ */
+struct remote {
+	struct wl_display *display;
+	struct wl_event_source *tick;
+	int width, height;
+	int refresh_mhz;
+
+	/* Committed wl_callback and wp_presentation_feedback resources */
+	struct wl_list frame_callbacks;
+	struct wl_list feedbacks;
+	uint64_t seq;
+
+	uint64_t commits;
+	uint64_t buffer_commits;
+	uint64_t frames;
+};
+
+bool remote_init(struct remote *remote, struct wl_display *display);
+
+/* A process sampled from /proc */
+struct process_sample {
+	/* utime + stime */
+	uint64_t cpu_nsec;
+	uint64_t rss_kb;
+};
+
+bool process_sample(pid_t pid, struct process_sample *sample);
+
+/* Values parsed from the "key value" lines of the panel's SIGUSR1 dump */
+struct panel_stats {
+	char *lines;
+	size_t len;
+};
+
+bool panel_stats_read(struct panel_stats *stats, FILE *stream);
+/* Returns @fallback when @key is missing */
+uint64_t panel_stats_get(struct panel_stats *stats, const char *key, uint64_t fallback);
+const char *panel_stats_get_string(struct panel_stats *stats, const char *key);
+void panel_stats_finish(struct panel_stats *stats);
+
+#endif /* CARTHUSIAN_BENCH_H */
@@ -0,0 +1,142 @@
+/*
+ * Synthetic load for carthusian-bench: maps --count toplevels, each of which
+ * repaints all of its contents --rate times a second. libcarthusian-plugin
+ * only drives one toplevel per connection, so every toplevel after the first
+ * gets its own process; they all exit when the panel goes away.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "carthusian-plugin.h"
+
+struct load {
+	struct carthusian_plugin *plugin;
+	int width, height;
+	uint32_t frame;
+};
+
+static void
+handle_draw(void *data, struct carthusian_plugin *plugin,
+		struct carthusian_plugin_buffer *buffer)
+{
+	struct load *load = data;
+	/* Change every pixel so nothing can be skipped along the way */
+	uint32_t color = 0xff000000 | (load->frame * 0x010203);
+	for (int y = 0; y < buffer->height; y++) {
+		uint32_t *row = (uint32_t *)((char *)buffer->data + y * buffer->stride);
+		for (int x = 0; x < buffer->width; x++) {
+			row[x] = color;
+		}
+	}
+}
+
+static void
+handle_configure(void *data, struct carthusian_plugin *plugin, int width, int height)
+{
+	struct load *load = data;
+	load->width = width;
+	load->height = height;
+}
+
+static const struct carthusian_plugin_listener listener = {
+	.draw = handle_draw,
+	.configure = handle_configure,
+};
+
+static void
+handle_timer(void *data)
+{
+	struct load *load = data;
+	load->frame++;
+	carthusian_plugin_damage(load->plugin, 0, 0, load->width, load->height);
+}
+
+static int
+run(int index, int rate, int width, int height)
+{
+	char app_id[64];
+	snprintf(app_id, sizeof(app_id), "carthusian-bench-%d", index);
+	struct load load = {
+		.width = width,
+		.height = height,
+	};
+	load.plugin = carthusian_plugin_create(app_id, width, height, 3, &listener,
+		&load);
+	if (!load.plugin) {
+		return EXIT_FAILURE;
+	}
+	int interval_ms = rate < 1000 ? 1000 / rate : 1;
+	if (!carthusian_plugin_set_timer(load.plugin, interval_ms, handle_timer, &load)) {
+		fprintf(stderr, "bench-load-plugin: cannot create timer\n");
+		carthusian_plugin_destroy(load.plugin);
+		return EXIT_FAILURE;
+	}
+	carthusian_plugin_damage(load.plugin, 0, 0, width, height);
+	int ret = carthusian_plugin_run(load.plugin);
+	carthusian_plugin_destroy(load.plugin);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static const struct option long_options[] = {
+	{"count", required_argument, NULL, 'n'},
+	{"rate", required_argument, NULL, 'r'},
+	{"size", required_argument, NULL, 's'},
+	{"help", no_argument, NULL, 'h'},
+	{0, 0, 0, 0}
+};
+
+static const char usage[] =
+"Usage: bench-load-plugin [options...]\n"
+"  -n, --count <n>      Number of toplevels (default 1)\n"
+"  -r, --rate <hz>      Repaints per second per toplevel (default 60)\n"
+"  -s, --size <w>x<h>   Toplevel size (default 100x30)\n"
+"  -h, --help           Show help message and quit\n";
+
+int
+main(int argc, char **argv)
+{
+	int count = 1, rate = 60, width = 100, height = 30;
+
+	int c;
+	while ((c = getopt_long(argc, argv, "n:r:s:h", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 's':
+			if (sscanf(optarg, "%dx%d", &width, &height) != 2) {
+				fprintf(stderr, "%s", usage);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'h':
+			printf("%s", usage);
+			exit(EXIT_SUCCESS);
+		default:
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (count < 1 || rate < 1 || width < 1 || height < 1) {
+		fprintf(stderr, "%s", usage);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Fork before connecting so no Wayland state is shared */
+	int index = 0;
+	for (int i = 1; i < count; i++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			break;
+		} else if (pid == 0) {
+			index = i;
+			break;
+		}
+	}
+	return run(index, rate, width, height);
+}
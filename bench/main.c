@@ -0,0 +1,418 @@
+/*
+ * carthusian-bench runs the panel headless against the stand-in remote
+ * compositor in remote.c, loads it with bench-load-plugin and reports CPU
+ * time, RSS, remote commit rate and the panel's own latency histograms as
+ * JSON, so runs can be compared with a script.
+ *
+ * CPU time and remote commits are measured over --duration seconds after
+ * --warmup; the latency histograms come from the panel's SIGUSR1 dump and
+ * cover its whole lifetime.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "bench.h"
+
+#define SAMPLE_INTERVAL_MS (100)
+/* Time given to the panel to write its statistics after SIGUSR1 */
+#define DUMP_GRACE_MS (250)
+
+extern char **environ;
+
+enum bench_state {
+	BENCH_WARMUP,
+	BENCH_MEASURING,
+	BENCH_DUMPING,
+	BENCH_DONE,
+};
+
+struct bench {
+	struct wl_display *display;
+	struct remote remote;
+
+	const char *panel_path;
+	const char *load_plugin_path;
+	int plugins;
+	int rate;
+	int width, height;
+	int warmup_ms;
+	int duration_ms;
+
+	pid_t panel_pid;
+	bool panel_exited;
+	FILE *panel_log;
+
+	enum bench_state state;
+	struct wl_event_source *state_timer;
+	struct wl_event_source *sample_timer;
+
+	struct timespec start_time, end_time;
+	struct process_sample start_sample, end_sample;
+	uint64_t rss_max_kb;
+	uint64_t start_commits, end_commits;
+	uint64_t start_buffer_commits, end_buffer_commits;
+	uint64_t start_frames, end_frames;
+};
+
+static double
+seconds_between(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static bool
+spawn_panel(struct bench *bench, const char *socket)
+{
+	char plugin[512];
+	snprintf(plugin, sizeof(plugin), "%s --count %d --rate %d --size %dx%d",
+		bench->load_plugin_path, bench->plugins, bench->rate, bench->width,
+		bench->height);
+	char *argv[] = {
+		(char *)bench->panel_path,
+		"--plugin", plugin,
+		NULL,
+	};
+
+	bench->panel_log = tmpfile();
+	if (!bench->panel_log) {
+		perror("tmpfile");
+		return false;
+	}
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fileno(bench->panel_log),
+		STDERR_FILENO);
+
+	/* The event loop blocks signals it handles, so unblock them in the child */
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &sigmask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+	setenv("WAYLAND_DISPLAY", socket, true);
+	int ret = posix_spawn(&bench->panel_pid, bench->panel_path, &actions, &attr,
+		argv, environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	if (ret != 0) {
+		fprintf(stderr, "bench: cannot start %s: %s\n", bench->panel_path,
+			strerror(ret));
+		return false;
+	}
+	return true;
+}
+
+static void
+take_sample(struct bench *bench, struct process_sample *sample)
+{
+	if (!process_sample(bench->panel_pid, sample)) {
+		return;
+	}
+	if (sample->rss_kb > bench->rss_max_kb) {
+		bench->rss_max_kb = sample->rss_kb;
+	}
+}
+
+static int
+handle_sample_timer(void *data)
+{
+	struct bench *bench = data;
+	struct process_sample sample;
+	take_sample(bench, &sample);
+	wl_event_source_timer_update(bench->sample_timer, SAMPLE_INTERVAL_MS);
+	return 0;
+}
+
+static int
+handle_state_timer(void *data)
+{
+	struct bench *bench = data;
+	struct remote *remote = &bench->remote;
+
+	switch (bench->state) {
+	case BENCH_WARMUP:
+		clock_gettime(CLOCK_MONOTONIC, &bench->start_time);
+		take_sample(bench, &bench->start_sample);
+		bench->rss_max_kb = bench->start_sample.rss_kb;
+		bench->start_commits = remote->commits;
+		bench->start_buffer_commits = remote->buffer_commits;
+		bench->start_frames = remote->frames;
+		bench->state = BENCH_MEASURING;
+		wl_event_source_timer_update(bench->state_timer, bench->duration_ms);
+		break;
+	case BENCH_MEASURING:
+		clock_gettime(CLOCK_MONOTONIC, &bench->end_time);
+		take_sample(bench, &bench->end_sample);
+		bench->end_commits = remote->commits;
+		bench->end_buffer_commits = remote->buffer_commits;
+		bench->end_frames = remote->frames;
+		kill(bench->panel_pid, SIGUSR1);
+		bench->state = BENCH_DUMPING;
+		wl_event_source_timer_update(bench->state_timer, DUMP_GRACE_MS);
+		break;
+	case BENCH_DUMPING:
+		bench->state = BENCH_DONE;
+		wl_display_terminate(bench->display);
+		break;
+	case BENCH_DONE:
+		break;
+	}
+	return 0;
+}
+
+static int
+handle_sigchld(int signal, void *data)
+{
+	struct bench *bench = data;
+	int status;
+	if (waitpid(bench->panel_pid, &status, WNOHANG) == bench->panel_pid) {
+		fprintf(stderr, "bench: panel exited early with status %d\n", status);
+		bench->panel_exited = true;
+		wl_display_terminate(bench->display);
+	}
+	return 0;
+}
+
+static void
+stop_panel(struct bench *bench)
+{
+	if (bench->panel_exited) {
+		return;
+	}
+	kill(bench->panel_pid, SIGTERM);
+	while (waitpid(bench->panel_pid, NULL, 0) < 0 && errno == EINTR) {
+	}
+}
+
+static void
+write_histogram(FILE *out, struct panel_stats *stats, const char *prefix,
+		const char *name, const char *indent)
+{
+	char key[128];
+	snprintf(key, sizeof(key), "%s.count", prefix);
+	fprintf(out, "%s\"%s_count\": %" PRIu64 ",\n", indent, name,
+		panel_stats_get(stats, key, 0));
+	snprintf(key, sizeof(key), "%s.avg_us", prefix);
+	fprintf(out, "%s\"%s_avg_us\": %" PRIu64 ",\n", indent, name,
+		panel_stats_get(stats, key, 0));
+	snprintf(key, sizeof(key), "%s.max_us", prefix);
+	fprintf(out, "%s\"%s_max_us\": %" PRIu64, indent, name,
+		panel_stats_get(stats, key, 0));
+}
+
+/* app_id is chosen by the load plugin, so it is not escaped */
+static int
+write_report(struct bench *bench, FILE *out)
+{
+	struct panel_stats stats;
+	rewind(bench->panel_log);
+	if (!panel_stats_read(&stats, bench->panel_log)) {
+		return -1;
+	}
+
+	double seconds = seconds_between(&bench->start_time, &bench->end_time);
+	uint64_t cpu_nsec = bench->end_sample.cpu_nsec - bench->start_sample.cpu_nsec;
+	uint64_t commits = bench->end_commits - bench->start_commits;
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"config\": {\n");
+	fprintf(out, "    \"plugins\": %d,\n", bench->plugins);
+	fprintf(out, "    \"rate_hz\": %d,\n", bench->rate);
+	fprintf(out, "    \"width\": %d,\n", bench->width);
+	fprintf(out, "    \"height\": %d,\n", bench->height);
+	fprintf(out, "    \"duration_s\": %.3f\n", seconds);
+	fprintf(out, "  },\n");
+
+	fprintf(out, "  \"panel\": {\n");
+	fprintf(out, "    \"cpu_ms\": %" PRIu64 ",\n", cpu_nsec / 1000000);
+	fprintf(out, "    \"cpu_percent\": %.2f,\n",
+		seconds > 0 ? cpu_nsec / 1e7 / seconds : 0.0);
+	fprintf(out, "    \"rss_kb\": %" PRIu64 ",\n", bench->end_sample.rss_kb);
+	fprintf(out, "    \"rss_max_kb\": %" PRIu64 ",\n", bench->rss_max_kb);
+	fprintf(out, "    \"first_frame_us\": %" PRIu64 "\n",
+		panel_stats_get(&stats, "startup.first_present_us", 0));
+	fprintf(out, "  },\n");
+
+	fprintf(out, "  \"remote\": {\n");
+	fprintf(out, "    \"commits\": %" PRIu64 ",\n", commits);
+	fprintf(out, "    \"commits_per_s\": %.2f,\n",
+		seconds > 0 ? commits / seconds : 0.0);
+	fprintf(out, "    \"buffer_commits\": %" PRIu64 ",\n",
+		bench->end_buffer_commits - bench->start_buffer_commits);
+	fprintf(out, "    \"frames\": %" PRIu64 "\n",
+		bench->end_frames - bench->start_frames);
+	fprintf(out, "  },\n");
+
+	fprintf(out, "  \"output\": {\n");
+	fprintf(out, "    \"commits\": %" PRIu64 ",\n",
+		panel_stats_get(&stats, "output.commits", 0));
+	fprintf(out, "    \"commits_skipped\": %" PRIu64 ",\n",
+		panel_stats_get(&stats, "output.commits_skipped", 0));
+	write_histogram(out, &stats, "output.scene_to_present", "scene_to_present",
+		"    ");
+	fprintf(out, "\n  },\n");
+
+	fprintf(out, "  \"plugins\": [");
+	int mapped = 0;
+	for (int i = 0; ; i++) {
+		char key[64];
+		snprintf(key, sizeof(key), "plugin.%d.app_id", i);
+		const char *app_id = panel_stats_get_string(&stats, key);
+		if (!app_id) {
+			break;
+		}
+		fprintf(out, "%s\n    {\n", i ? "," : "");
+		fprintf(out, "      \"app_id\": \"%s\",\n", app_id);
+		snprintf(key, sizeof(key), "plugin.%d.commit_to_scene", i);
+		write_histogram(out, &stats, key, "commit_to_scene", "      ");
+		fprintf(out, ",\n");
+		snprintf(key, sizeof(key), "plugin.%d.commit_to_present", i);
+		write_histogram(out, &stats, key, "commit_to_present", "      ");
+		fprintf(out, "\n    }");
+		mapped++;
+	}
+	fprintf(out, "%s]\n", mapped ? "\n  " : "");
+	fprintf(out, "}\n");
+
+	panel_stats_finish(&stats);
+	if (mapped < bench->plugins) {
+		fprintf(stderr, "bench: only %d of %d plugins were mapped\n", mapped,
+			bench->plugins);
+		return -1;
+	}
+	return 0;
+}
+
+static const struct option long_options[] = {
+	{"panel", required_argument, NULL, 'P'},
+	{"load-plugin", required_argument, NULL, 'L'},
+	{"count", required_argument, NULL, 'n'},
+	{"rate", required_argument, NULL, 'r'},
+	{"size", required_argument, NULL, 's'},
+	{"warmup", required_argument, NULL, 'w'},
+	{"duration", required_argument, NULL, 't'},
+	{"output", required_argument, NULL, 'o'},
+	{"help", no_argument, NULL, 'h'},
+	{0, 0, 0, 0}
+};
+
+static const char usage[] =
+"Usage: carthusian-bench --panel <path> --load-plugin <path> [options...]\n"
+"  -P, --panel <path>         Panel executable to run\n"
+"  -L, --load-plugin <path>   bench-load-plugin executable\n"
+"  -n, --count <n>            Number of plugin toplevels (default 3)\n"
+"  -r, --rate <hz>            Commits per second per toplevel (default 60)\n"
+"  -s, --size <w>x<h>         Toplevel size (default 100x30)\n"
+"  -w, --warmup <ms>          Time to let the panel start (default 2000)\n"
+"  -t, --duration <ms>        Time to measure for (default 10000)\n"
+"  -o, --output <file>        Write the JSON report here instead of stdout\n"
+"  -h, --help                 Show help message and quit\n";
+
+int
+main(int argc, char **argv)
+{
+	struct bench bench = {
+		.plugins = 3,
+		.rate = 60,
+		.width = 100,
+		.height = 30,
+		.warmup_ms = 2000,
+		.duration_ms = 10000,
+	};
+	const char *output = NULL;
+
+	int c;
+	while ((c = getopt_long(argc, argv, "P:L:n:r:s:w:t:o:h", long_options,
+			NULL)) != -1) {
+		switch (c) {
+		case 'P':
+			bench.panel_path = optarg;
+			break;
+		case 'L':
+			bench.load_plugin_path = optarg;
+			break;
+		case 'n':
+			bench.plugins = atoi(optarg);
+			break;
+		case 'r':
+			bench.rate = atoi(optarg);
+			break;
+		case 's':
+			if (sscanf(optarg, "%dx%d", &bench.width, &bench.height) != 2) {
+				fprintf(stderr, "%s", usage);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'w':
+			bench.warmup_ms = atoi(optarg);
+			break;
+		case 't':
+			bench.duration_ms = atoi(optarg);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'h':
+			printf("%s", usage);
+			exit(EXIT_SUCCESS);
+		default:
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (!bench.panel_path || !bench.load_plugin_path || bench.plugins < 1 ||
+			bench.rate < 1 || bench.warmup_ms < 1 || bench.duration_ms < 1) {
+		fprintf(stderr, "%s", usage);
+		exit(EXIT_FAILURE);
+	}
+
+	bench.display = wl_display_create();
+	if (!bench.display) {
+		exit(EXIT_FAILURE);
+	}
+	const char *socket = wl_display_add_socket_auto(bench.display);
+	if (!socket || !remote_init(&bench.remote, bench.display)) {
+		fprintf(stderr, "bench: cannot create the stand-in compositor\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct wl_event_loop *loop = wl_display_get_event_loop(bench.display);
+	wl_event_loop_add_signal(loop, SIGCHLD, handle_sigchld, &bench);
+	bench.state_timer = wl_event_loop_add_timer(loop, handle_state_timer, &bench);
+	bench.sample_timer = wl_event_loop_add_timer(loop, handle_sample_timer, &bench);
+
+	if (!spawn_panel(&bench, socket)) {
+		exit(EXIT_FAILURE);
+	}
+	wl_event_source_timer_update(bench.state_timer, bench.warmup_ms);
+	wl_event_source_timer_update(bench.sample_timer, SAMPLE_INTERVAL_MS);
+
+	wl_display_run(bench.display);
+
+	stop_panel(&bench);
+	int ret = EXIT_FAILURE;
+	if (bench.state == BENCH_DONE) {
+		FILE *out = output ? fopen(output, "w") : stdout;
+		if (!out) {
+			perror(output);
+		} else {
+			ret = write_report(&bench, out) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+			if (out != stdout) {
+				fclose(out);
+			}
+		}
+	}
+
+	wl_display_destroy_clients(bench.display);
+	wl_display_destroy(bench.display);
+	fclose(bench.panel_log);
+	return ret;
+}
@@ -0,0 +1,644 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wayland-server-core.h>
+#include <wayland-server-protocol.h>
+#include "bench.h"
+#include "presentation-time-protocol.h"
+#include "wlr-layer-shell-unstable-v1-protocol.h"
+#include "xdg-shell-protocol.h"
+
+struct remote_layer_surface;
+
+struct remote_surface {
+	struct remote *remote;
+	struct wl_resource *resource;
+
+	/* Pending state, applied on commit */
+	struct wl_resource *buffer;
+	struct wl_listener buffer_destroy;
+	struct wl_list frame_callbacks;
+	struct wl_list feedbacks;
+
+	struct remote_layer_surface *layer;
+};
+
+struct remote_layer_surface {
+	struct wl_resource *resource;
+	struct remote_surface *surface;
+	uint32_t width, height;
+	uint32_t serial;
+	bool configured;
+};
+
+static void
+destroy_resource(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+unlink_resource(struct wl_resource *resource)
+{
+	wl_list_remove(wl_resource_get_link(resource));
+}
+
+static struct wl_resource *
+create_linked_resource(struct wl_client *client, const struct wl_interface *interface,
+		int version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client, interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return NULL;
+	}
+	wl_list_init(wl_resource_get_link(resource));
+	wl_resource_set_implementation(resource, NULL, NULL, unlink_resource);
+	return resource;
+}
+
+static void
+region_add(struct wl_client *client, struct wl_resource *resource, int32_t x,
+		int32_t y, int32_t width, int32_t height)
+{
+	/* Input and opaque regions have no effect here */
+}
+
+static const struct wl_region_interface region_impl = {
+	.destroy = destroy_resource,
+	.add = region_add,
+	.subtract = region_add,
+};
+
+static void
+surface_set_buffer(struct remote_surface *surface, struct wl_resource *buffer)
+{
+	if (surface->buffer) {
+		wl_list_remove(&surface->buffer_destroy.link);
+	}
+	surface->buffer = buffer;
+	if (buffer) {
+		wl_resource_add_destroy_listener(buffer, &surface->buffer_destroy);
+	}
+}
+
+static void
+surface_handle_buffer_destroy(struct wl_listener *listener, void *data)
+{
+	struct remote_surface *surface =
+		wl_container_of(listener, surface, buffer_destroy);
+	wl_list_remove(&surface->buffer_destroy.link);
+	surface->buffer = NULL;
+}
+
+static void
+surface_attach(struct wl_client *client, struct wl_resource *resource,
+		struct wl_resource *buffer, int32_t x, int32_t y)
+{
+	struct remote_surface *surface = wl_resource_get_user_data(resource);
+	surface_set_buffer(surface, buffer);
+}
+
+static void
+surface_damage(struct wl_client *client, struct wl_resource *resource, int32_t x,
+		int32_t y, int32_t width, int32_t height)
+{
+	/* Everything is "copied" on commit, so damage is not tracked */
+}
+
+static void
+surface_frame(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+	struct remote_surface *surface = wl_resource_get_user_data(resource);
+	struct wl_resource *callback = create_linked_resource(client,
+		&wl_callback_interface, 1, id);
+	if (callback) {
+		wl_list_insert(surface->frame_callbacks.prev,
+			wl_resource_get_link(callback));
+	}
+}
+
+static void
+surface_set_region(struct wl_client *client, struct wl_resource *resource,
+		struct wl_resource *region)
+{
+}
+
+static void
+surface_commit(struct wl_client *client, struct wl_resource *resource)
+{
+	struct remote_surface *surface = wl_resource_get_user_data(resource);
+	struct remote *remote = surface->remote;
+
+	remote->commits++;
+	if (surface->buffer) {
+		/* Pretend the contents were copied right away */
+		remote->buffer_commits++;
+		wl_buffer_send_release(surface->buffer);
+		surface_set_buffer(surface, NULL);
+	}
+	wl_list_insert_list(remote->frame_callbacks.prev, &surface->frame_callbacks);
+	wl_list_init(&surface->frame_callbacks);
+	wl_list_insert_list(remote->feedbacks.prev, &surface->feedbacks);
+	wl_list_init(&surface->feedbacks);
+
+	struct remote_layer_surface *layer = surface->layer;
+	if (layer && !layer->configured) {
+		layer->configured = true;
+		zwlr_layer_surface_v1_send_configure(layer->resource, ++layer->serial,
+			layer->width ? layer->width : (uint32_t)remote->width,
+			layer->height ? layer->height : (uint32_t)remote->height);
+	}
+}
+
+static void
+surface_set_int(struct wl_client *client, struct wl_resource *resource, int32_t value)
+{
+}
+
+static const struct wl_surface_interface surface_impl = {
+	.destroy = destroy_resource,
+	.attach = surface_attach,
+	.damage = surface_damage,
+	.frame = surface_frame,
+	.set_opaque_region = surface_set_region,
+	.set_input_region = surface_set_region,
+	.commit = surface_commit,
+	.set_buffer_transform = surface_set_int,
+	.set_buffer_scale = surface_set_int,
+	.damage_buffer = surface_damage,
+};
+
+static void
+surface_handle_resource_destroy(struct wl_resource *resource)
+{
+	struct remote_surface *surface = wl_resource_get_user_data(resource);
+	surface_set_buffer(surface, NULL);
+
+	struct wl_resource *callback, *tmp;
+	wl_resource_for_each_safe(callback, tmp, &surface->frame_callbacks) {
+		wl_list_remove(wl_resource_get_link(callback));
+		wl_list_init(wl_resource_get_link(callback));
+	}
+	wl_resource_for_each_safe(callback, tmp, &surface->feedbacks) {
+		wp_presentation_feedback_send_discarded(callback);
+		wl_resource_destroy(callback);
+	}
+	if (surface->layer) {
+		surface->layer->surface = NULL;
+	}
+	free(surface);
+}
+
+static void
+compositor_create_surface(struct wl_client *client, struct wl_resource *resource,
+		uint32_t id)
+{
+	struct remote_surface *surface = calloc(1, sizeof(*surface));
+	if (!surface) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	surface->resource = wl_resource_create(client, &wl_surface_interface,
+		wl_resource_get_version(resource), id);
+	if (!surface->resource) {
+		free(surface);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	surface->remote = wl_resource_get_user_data(resource);
+	surface->buffer_destroy.notify = surface_handle_buffer_destroy;
+	wl_list_init(&surface->frame_callbacks);
+	wl_list_init(&surface->feedbacks);
+	wl_resource_set_implementation(surface->resource, &surface_impl, surface,
+		surface_handle_resource_destroy);
+}
+
+static void
+compositor_create_region(struct wl_client *client, struct wl_resource *resource,
+		uint32_t id)
+{
+	struct wl_resource *region = wl_resource_create(client, &wl_region_interface,
+		1, id);
+	if (!region) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(region, &region_impl, NULL, NULL);
+}
+
+static const struct wl_compositor_interface compositor_impl = {
+	.create_surface = compositor_create_surface,
+	.create_region = compositor_create_region,
+};
+
+static void
+bind_compositor(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client,
+		&wl_compositor_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &compositor_impl, data, NULL);
+}
+
+static void
+subsurface_set_position(struct wl_client *client, struct wl_resource *resource,
+		int32_t x, int32_t y)
+{
+}
+
+static void
+subsurface_place(struct wl_client *client, struct wl_resource *resource,
+		struct wl_resource *sibling)
+{
+}
+
+static void
+subsurface_set_mode(struct wl_client *client, struct wl_resource *resource)
+{
+	/*
+	 * Sub-surface commits are applied immediately in both modes; the
+	 * stand-in only counts them.
+	 */
+}
+
+static const struct wl_subsurface_interface subsurface_impl = {
+	.destroy = destroy_resource,
+	.set_position = subsurface_set_position,
+	.place_above = subsurface_place,
+	.place_below = subsurface_place,
+	.set_sync = subsurface_set_mode,
+	.set_desync = subsurface_set_mode,
+};
+
+static void
+subcompositor_get_subsurface(struct wl_client *client, struct wl_resource *resource,
+		uint32_t id, struct wl_resource *surface, struct wl_resource *parent)
+{
+	struct wl_resource *subsurface = wl_resource_create(client,
+		&wl_subsurface_interface, 1, id);
+	if (!subsurface) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(subsurface, &subsurface_impl, NULL, NULL);
+}
+
+static const struct wl_subcompositor_interface subcompositor_impl = {
+	.destroy = destroy_resource,
+	.get_subsurface = subcompositor_get_subsurface,
+};
+
+static void
+bind_subcompositor(struct wl_client *client, void *data, uint32_t version,
+		uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client,
+		&wl_subcompositor_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &subcompositor_impl, data, NULL);
+}
+
+static void
+pointer_set_cursor(struct wl_client *client, struct wl_resource *resource,
+		uint32_t serial, struct wl_resource *surface, int32_t hotspot_x,
+		int32_t hotspot_y)
+{
+}
+
+static const struct wl_pointer_interface pointer_impl = {
+	.set_cursor = pointer_set_cursor,
+	.release = destroy_resource,
+};
+
+static void
+seat_get_pointer(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+	struct wl_resource *pointer = wl_resource_create(client, &wl_pointer_interface,
+		wl_resource_get_version(resource), id);
+	if (!pointer) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(pointer, &pointer_impl, NULL, NULL);
+}
+
+static void
+seat_get_unsupported(struct wl_client *client, struct wl_resource *resource,
+		uint32_t id)
+{
+	wl_resource_post_error(resource, WL_SEAT_ERROR_MISSING_CAPABILITY,
+		"the stand-in seat only has a pointer");
+}
+
+static const struct wl_seat_interface seat_impl = {
+	.get_pointer = seat_get_pointer,
+	.get_keyboard = seat_get_unsupported,
+	.get_touch = seat_get_unsupported,
+	.release = destroy_resource,
+};
+
+static void
+bind_seat(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client, &wl_seat_interface,
+		version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &seat_impl, data, NULL);
+	wl_seat_send_capabilities(resource, WL_SEAT_CAPABILITY_POINTER);
+	if (version >= WL_SEAT_NAME_SINCE_VERSION) {
+		wl_seat_send_name(resource, "seat0");
+	}
+}
+
+static const struct wl_output_interface output_impl = {
+	.release = destroy_resource,
+};
+
+static void
+bind_output(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct remote *remote = data;
+	struct wl_resource *resource = wl_resource_create(client, &wl_output_interface,
+		version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &output_impl, remote, NULL);
+	wl_output_send_geometry(resource, 0, 0, 0, 0, WL_OUTPUT_SUBPIXEL_UNKNOWN,
+		"carthusian", "bench", WL_OUTPUT_TRANSFORM_NORMAL);
+	wl_output_send_mode(resource, WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED,
+		remote->width, remote->height, remote->refresh_mhz);
+	if (version >= WL_OUTPUT_SCALE_SINCE_VERSION) {
+		wl_output_send_scale(resource, 1);
+	}
+	if (version >= WL_OUTPUT_NAME_SINCE_VERSION) {
+		wl_output_send_name(resource, "BENCH-1");
+	}
+	if (version >= WL_OUTPUT_DONE_SINCE_VERSION) {
+		wl_output_send_done(resource);
+	}
+}
+
+static void
+layer_surface_set_size(struct wl_client *client, struct wl_resource *resource,
+		uint32_t width, uint32_t height)
+{
+	struct remote_layer_surface *layer = wl_resource_get_user_data(resource);
+	layer->width = width;
+	layer->height = height;
+}
+
+static void
+layer_surface_set_uint(struct wl_client *client, struct wl_resource *resource,
+		uint32_t value)
+{
+}
+
+static void
+layer_surface_set_exclusive_zone(struct wl_client *client,
+		struct wl_resource *resource, int32_t zone)
+{
+}
+
+static void
+layer_surface_set_margin(struct wl_client *client, struct wl_resource *resource,
+		int32_t top, int32_t right, int32_t bottom, int32_t left)
+{
+}
+
+static void
+layer_surface_get_popup(struct wl_client *client, struct wl_resource *resource,
+		struct wl_resource *popup)
+{
+}
+
+static void
+layer_surface_ack_configure(struct wl_client *client, struct wl_resource *resource,
+		uint32_t serial)
+{
+}
+
+static const struct zwlr_layer_surface_v1_interface layer_surface_impl = {
+	.set_size = layer_surface_set_size,
+	.set_anchor = layer_surface_set_uint,
+	.set_exclusive_zone = layer_surface_set_exclusive_zone,
+	.set_margin = layer_surface_set_margin,
+	.set_keyboard_interactivity = layer_surface_set_uint,
+	.get_popup = layer_surface_get_popup,
+	.ack_configure = layer_surface_ack_configure,
+	.destroy = destroy_resource,
+	.set_layer = layer_surface_set_uint,
+};
+
+static void
+layer_surface_handle_resource_destroy(struct wl_resource *resource)
+{
+	struct remote_layer_surface *layer = wl_resource_get_user_data(resource);
+	if (layer->surface) {
+		layer->surface->layer = NULL;
+	}
+	free(layer);
+}
+
+static void
+layer_shell_get_layer_surface(struct wl_client *client, struct wl_resource *resource,
+		uint32_t id, struct wl_resource *surface_resource,
+		struct wl_resource *output, uint32_t layer_index, const char *namespace)
+{
+	struct remote_surface *surface = wl_resource_get_user_data(surface_resource);
+	struct remote_layer_surface *layer = calloc(1, sizeof(*layer));
+	if (!layer) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	layer->resource = wl_resource_create(client, &zwlr_layer_surface_v1_interface,
+		wl_resource_get_version(resource), id);
+	if (!layer->resource) {
+		free(layer);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	layer->surface = surface;
+	surface->layer = layer;
+	wl_resource_set_implementation(layer->resource, &layer_surface_impl, layer,
+		layer_surface_handle_resource_destroy);
+}
+
+static const struct zwlr_layer_shell_v1_interface layer_shell_impl = {
+	.get_layer_surface = layer_shell_get_layer_surface,
+	.destroy = destroy_resource,
+};
+
+static void
+bind_layer_shell(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client,
+		&zwlr_layer_shell_v1_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &layer_shell_impl, data, NULL);
+}
+
+static void
+xdg_wm_base_unsupported(struct wl_client *client, struct wl_resource *resource,
+		uint32_t id)
+{
+	wl_client_post_implementation_error(client,
+		"the stand-in compositor has no xdg toplevels");
+}
+
+static void
+xdg_wm_base_get_xdg_surface(struct wl_client *client, struct wl_resource *resource,
+		uint32_t id, struct wl_resource *surface)
+{
+	xdg_wm_base_unsupported(client, resource, id);
+}
+
+static void
+xdg_wm_base_pong(struct wl_client *client, struct wl_resource *resource,
+		uint32_t serial)
+{
+}
+
+/*
+ * The wlroots Wayland backend refuses to start without xdg_wm_base, but the
+ * panel only nests outputs in its own subsurface, so nothing is ever created.
+ */
+static const struct xdg_wm_base_interface xdg_wm_base_impl = {
+	.destroy = destroy_resource,
+	.create_positioner = xdg_wm_base_unsupported,
+	.get_xdg_surface = xdg_wm_base_get_xdg_surface,
+	.pong = xdg_wm_base_pong,
+};
+
+static void
+bind_xdg_wm_base(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client, &xdg_wm_base_interface,
+		version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &xdg_wm_base_impl, data, NULL);
+}
+
+static void
+presentation_feedback(struct wl_client *client, struct wl_resource *resource,
+		struct wl_resource *surface_resource, uint32_t id)
+{
+	struct remote_surface *surface = wl_resource_get_user_data(surface_resource);
+	struct wl_resource *feedback = create_linked_resource(client,
+		&wp_presentation_feedback_interface, 1, id);
+	if (feedback) {
+		wl_list_insert(surface->feedbacks.prev, wl_resource_get_link(feedback));
+	}
+}
+
+static const struct wp_presentation_interface presentation_impl = {
+	.destroy = destroy_resource,
+	.feedback = presentation_feedback,
+};
+
+static void
+bind_presentation(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client,
+		&wp_presentation_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &presentation_impl, data, NULL);
+	wp_presentation_send_clock_id(resource, CLOCK_MONOTONIC);
+}
+
+static int
+refresh_interval_ms(struct remote *remote)
+{
+	return 1000000 / remote->refresh_mhz;
+}
+
+static int
+handle_tick(void *data)
+{
+	struct remote *remote = data;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint32_t msec = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	uint32_t refresh_nsec = 1000000000000ULL / remote->refresh_mhz;
+
+	remote->frames++;
+	remote->seq++;
+
+	struct wl_resource *resource, *tmp;
+	wl_resource_for_each_safe(resource, tmp, &remote->feedbacks) {
+		wp_presentation_feedback_send_presented(resource,
+			(uint64_t)now.tv_sec >> 32, now.tv_sec & 0xffffffff, now.tv_nsec,
+			refresh_nsec, remote->seq >> 32, remote->seq & 0xffffffff,
+			WP_PRESENTATION_FEEDBACK_KIND_VSYNC);
+		wl_resource_destroy(resource);
+	}
+	wl_resource_for_each_safe(resource, tmp, &remote->frame_callbacks) {
+		wl_callback_send_done(resource, msec);
+		wl_resource_destroy(resource);
+	}
+
+	wl_event_source_timer_update(remote->tick, refresh_interval_ms(remote));
+	return 0;
+}
+
+bool
+remote_init(struct remote *remote, struct wl_display *display)
+{
+	remote->display = display;
+	if (!remote->width) {
+		remote->width = 1920;
+	}
+	if (!remote->height) {
+		remote->height = 1080;
+	}
+	if (!remote->refresh_mhz) {
+		remote->refresh_mhz = 60000;
+	}
+	wl_list_init(&remote->frame_callbacks);
+	wl_list_init(&remote->feedbacks);
+
+	if (wl_display_init_shm(display) != 0 ||
+			!wl_global_create(display, &wl_compositor_interface, 4, remote,
+				bind_compositor) ||
+			!wl_global_create(display, &wl_subcompositor_interface, 1, remote,
+				bind_subcompositor) ||
+			!wl_global_create(display, &wl_seat_interface, 7, remote, bind_seat) ||
+			!wl_global_create(display, &wl_output_interface, 4, remote,
+				bind_output) ||
+			!wl_global_create(display, &zwlr_layer_shell_v1_interface, 4, remote,
+				bind_layer_shell) ||
+			!wl_global_create(display, &xdg_wm_base_interface, 1, remote,
+				bind_xdg_wm_base) ||
+			!wl_global_create(display, &wp_presentation_interface, 1, remote,
+				bind_presentation)) {
+		return false;
+	}
+
+	struct wl_event_loop *loop = wl_display_get_event_loop(display);
+	remote->tick = wl_event_loop_add_timer(loop, handle_tick, remote);
+	if (!remote->tick) {
+		return false;
+	}
+	wl_event_source_timer_update(remote->tick, refresh_interval_ms(remote));
+	return true;
+}
@@ -0,0 +1,104 @@
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bench.h"
+
+bool
+process_sample(pid_t pid, struct process_sample *sample)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		return false;
+	}
+	char buf[1024];
+	size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[len] = '\0';
+
+	/* The command name may contain spaces, so start after its ')' */
+	char *p = strrchr(buf, ')');
+	if (!p) {
+		return false;
+	}
+	unsigned long utime, stime;
+	if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			&utime, &stime) != 2) {
+		return false;
+	}
+	long ticks = sysconf(_SC_CLK_TCK);
+	sample->cpu_nsec = (uint64_t)(utime + stime) * 1000000000 / ticks;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	f = fopen(path, "r");
+	if (!f) {
+		return false;
+	}
+	sample->rss_kb = 0;
+	char line[256];
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "VmRSS: %" SCNu64, &sample->rss_kb) == 1) {
+			break;
+		}
+	}
+	fclose(f);
+	return true;
+}
+
+bool
+panel_stats_read(struct panel_stats *stats, FILE *stream)
+{
+	stats->lines = NULL;
+	stats->len = 0;
+	FILE *memstream = open_memstream(&stats->lines, &stats->len);
+	if (!memstream) {
+		return false;
+	}
+	char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), stream)) > 0) {
+		fwrite(buf, 1, n, memstream);
+	}
+	fclose(memstream);
+
+	/* Split into NUL-terminated lines for lookups */
+	for (size_t i = 0; i < stats->len; i++) {
+		if (stats->lines[i] == '\n') {
+			stats->lines[i] = '\0';
+		}
+	}
+	return true;
+}
+
+/*
+ * The panel may have dumped its statistics more than once, so the last
+ * occurrence of a key wins.
+ */
+const char *
+panel_stats_get_string(struct panel_stats *stats, const char *key)
+{
+	const char *value = NULL;
+	size_t key_len = strlen(key);
+	for (size_t i = 0; i < stats->len; i += strlen(stats->lines + i) + 1) {
+		const char *line = stats->lines + i;
+		if (!strncmp(line, key, key_len) && line[key_len] == ' ') {
+			value = line + key_len + 1;
+		}
+	}
+	return value;
+}
+
+uint64_t
+panel_stats_get(struct panel_stats *stats, const char *key, uint64_t fallback)
+{
+	const char *value = panel_stats_get_string(stats, key);
+	return value ? strtoull(value, NULL, 10) : fallback;
+}
+
+void
+panel_stats_finish(struct panel_stats *stats)
+{
+	free(stats->lines);
+}
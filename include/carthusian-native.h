@@ -0,0 +1,83 @@
+#ifndef CARTHUSIAN_NATIVE_H
+#define CARTHUSIAN_NATIVE_H
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Native plugins are shared objects loaded into the panel process which draw
+ * straight into the panel's scene-graph instead of being separate Wayland
+ * clients.
+ *
+ * A plugin exports CARTHUSIAN_NATIVE_ENTRY, which returns a description of
+ * the plugin. The panel refuses to load a plugin built against a different
+ * CARTHUSIAN_NATIVE_ABI_VERSION. New members are only ever appended to the
+ * structs below, and doing so bumps the ABI version.
+ */
+#define CARTHUSIAN_NATIVE_ABI_VERSION (2)
+#define CARTHUSIAN_NATIVE_ENTRY "carthusian_native_plugin"
+
+/* Opaque handles owned by the panel */
+struct carthusian_native_host;
+struct carthusian_native_timer;
+
+/* Functions provided by the panel to each plugin instance */
+struct carthusian_native_host_api {
+	uint32_t abi_version;
+
+	/*
+	 * Ask for a new size. The panel answers with configure() which carries
+	 * the size actually granted, for example with the height limited to
+	 * that of the panel.
+	 */
+	void (*set_size)(struct carthusian_native_host *host, int width, int height);
+
+	/* Have draw() called before the next frame */
+	void (*schedule_draw)(struct carthusian_native_host *host);
+
+	/* Timers run on the panel's event loop; a timeout of 0 disarms */
+	struct carthusian_native_timer *(*timer_add)(struct carthusian_native_host *host,
+		void (*callback)(void *data), void *data);
+	void (*timer_update)(struct carthusian_native_timer *timer, int timeout_ms);
+	void (*timer_remove)(struct carthusian_native_timer *timer);
+};
+
+struct carthusian_native_plugin {
+	uint32_t abi_version;
+	const char *name;
+
+	/*
+	 * Create an instance. @args is the remainder of the command line the
+	 * plugin was loaded with, or an empty string. Returns NULL on failure.
+	 */
+	void *(*create)(struct carthusian_native_host *host,
+		const struct carthusian_native_host_api *api, const char *args);
+	void (*destroy)(void *data);
+
+	/* The size granted to the plugin has changed */
+	void (*configure)(void *data, int width, int height);
+
+	/*
+	 * Draw the whole plugin into @pixels, which are premultiplied ARGB8888.
+	 * @width and @height are in buffer pixels, that is the configured size
+	 * times the scale last passed to set_scale(). The buffer is only valid
+	 * for the duration of the call.
+	 */
+	void (*draw)(void *data, uint32_t *pixels, int width, int height, int stride);
+
+	/* Optional. Coordinates are relative to the top-left of the plugin */
+	void (*pointer_motion)(void *data, double x, double y);
+	void (*pointer_leave)(void *data);
+	void (*pointer_button)(void *data, double x, double y, uint32_t button,
+		bool pressed);
+
+	/*
+	 * Optional. The scale of the panels has changed, and draw() is called
+	 * with buffers this much larger than the configured size. Plugins
+	 * without it are drawn at scale 1 and upscaled by the panel.
+	 */
+	void (*set_scale)(void *data, double scale);
+};
+
+typedef const struct carthusian_native_plugin *(*carthusian_native_entry_t)(void);
+
+#endif /* CARTHUSIAN_NATIVE_H */
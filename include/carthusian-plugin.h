@@ -0,0 +1,69 @@
+#ifndef CARTHUSIAN_PLUGIN_H
+#define CARTHUSIAN_PLUGIN_H
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * libcarthusian-plugin is a small helper for writing plugins as plain
+ * Wayland clients. It maps a single xdg-shell toplevel backed by a set of
+ * reusable wl_shm buffers and paces redraws with frame callbacks, so a plugin
+ * only has to draw into memory.
+ *
+ * When draw() is called the buffer already holds the previously presented
+ * content, so only the damaged region needs to be drawn again.
+ */
+
+struct carthusian_plugin;
+
+struct carthusian_plugin_buffer {
+	/* Premultiplied ARGB8888 */
+	uint32_t *data;
+	int width;
+	int height;
+	/* In bytes */
+	int stride;
+};
+
+struct carthusian_plugin_listener {
+	/* Draw the region added with carthusian_plugin_damage() */
+	void (*draw)(void *data, struct carthusian_plugin *plugin,
+		struct carthusian_plugin_buffer *buffer);
+
+	/* Optional. The panel has asked for a new size */
+	void (*configure)(void *data, struct carthusian_plugin *plugin,
+		int width, int height);
+
+	/* Optional. Coordinates are surface-local */
+	void (*pointer_button)(void *data, struct carthusian_plugin *plugin,
+		double x, double y, uint32_t button, bool pressed);
+};
+
+/*
+ * Connect to $WAYLAND_DISPLAY and map a toplevel of the given size. Between
+ * two and three buffers are used; more only help when the compositor holds
+ * on to buffers for long. Returns NULL on failure.
+ */
+struct carthusian_plugin *carthusian_plugin_create(const char *app_id,
+	int width, int height, int nr_buffers,
+	const struct carthusian_plugin_listener *listener, void *data);
+void carthusian_plugin_destroy(struct carthusian_plugin *plugin);
+
+/* Add a region to redraw and have draw() called on the next frame */
+void carthusian_plugin_damage(struct carthusian_plugin *plugin,
+	int x, int y, int width, int height);
+
+/*
+ * Call @callback every @interval_ms milliseconds from carthusian_plugin_run().
+ * The first call is aligned to a multiple of the interval on the realtime
+ * clock, which suits clocks. Only one timer is supported.
+ */
+bool carthusian_plugin_set_timer(struct carthusian_plugin *plugin, int interval_ms,
+	void (*callback)(void *data), void *data);
+
+/* Dispatch events until the toplevel is closed; returns non-zero on error */
+int carthusian_plugin_run(struct carthusian_plugin *plugin);
+
+/* Stop carthusian_plugin_run() */
+void carthusian_plugin_close(struct carthusian_plugin *plugin);
+
+#endif /* CARTHUSIAN_PLUGIN_H */
@@ -15,21 +15,33 @@
 #include <wlr/render/allocator.h>
 #include <wlr/types/wlr_compositor.h>
 #include <wlr/types/wlr_cursor.h>
+#include <wlr/types/wlr_fractional_scale_v1.h>
+#include <wlr/types/wlr_output_layout.h>
+#include <wlr/types/wlr_presentation_time.h>
 #include <wlr/types/wlr_scene.h>
+#include <wlr/types/wlr_viewporter.h>
 #include <wlr/types/wlr_xcursor_manager.h>
 #include <wlr/types/wlr_xdg_shell.h>
 #include <wlr/util/log.h>
 #include <unistd.h>
+#include "fractional-scale-v1-client-protocol.h"
+#include "presentation-time-client-protocol.h"
+#include "single-pixel-buffer-v1-client-protocol.h"
+#include "viewporter-client-protocol.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 #include "xdg-shell-protocol.h"
 
+#define MARGIN_HORIZONTAL (3)
+#define MARGIN_VERTICAL (3)
+#define PADDING (3)
+
 struct frontend {
 	struct server *server;
 	struct wlr_seat *wlr_seat;
 
 	struct wl_display *local_display;
 
-	struct wlr_output *wlr_output;
+	/* Every panel's nested output is placed at 0,0, see panel.c */
 	struct wlr_scene_output_layout *scene_layout;
 	struct wlr_output_layout *output_layout;
 
@@ -54,6 +66,15 @@ struct seat {
 	char *name;
 
 	struct wlr_pointer wlr_pointer;
+	/* wlr_pointer is only initialised once the seat has a pointer */
+	bool has_pointer;
+
+	/* Motion received since the last wl_pointer.frame */
+	struct {
+		bool pending;
+		uint32_t time;
+		wl_fixed_t x, y;
+	} motion;
 };
 
 struct backend {
@@ -61,28 +82,203 @@ struct backend {
 	struct seat *seat;
 
 	struct wlr_backend *wlr_backend;
+	struct wlr_renderer *renderer;
+	struct wlr_allocator *allocator;
+	/* Panels can be created once the frontend is set up */
+	bool started;
 
 	struct wl_display *remote_display;
+	/* Pending until the initial globals have been announced */
+	struct wl_callback *globals_callback;
 	struct wl_compositor *compositor;
 	struct wl_subcompositor *subcompositor;
+	struct zwlr_layer_shell_v1 *layer_shell;
 	struct wl_shm *shm;
-	struct wl_surface *main_surface;
+	struct wp_presentation *presentation;
+	/* From wp_presentation.clock_id, -1 until known */
+	int presentation_clock;
+	struct wp_viewporter *viewporter;
+	struct wp_single_pixel_buffer_manager_v1 *single_pixel_buffer_manager;
+	struct wp_fractional_scale_manager_v1 *fractional_scale_manager;
 
+	/* Shared by the EGL surfaces of all panels */
 	struct {
-		struct wl_egl_window *window;
-		struct wlr_egl_surface *surface;
 		EGLDisplay display;
 		EGLConfig config;
 		EGLContext context;
 	} egl;
 };
 
+/*
+ * One panel is shown on each remote wl_output. Each has its own layer
+ * surface, background and nested output, but all nested outputs show the
+ * same scene, so plugins are only run once however many outputs there are.
+ */
+struct panel {
+	struct server *server;
+
+	/* The remote output and the name of its wl_registry global */
+	struct wl_output *wl_output;
+	uint32_t global_name;
+
+	struct zwlr_layer_surface_v1 *layer_surface;
+	struct wl_surface *main_surface;
+	struct wl_surface *child_surface;
+	struct wl_subsurface *subsurface;
+	/* Logical size, as configured by the layer shell */
+	int width, height;
+
+	/*
+	 * The nested output renders at the remote output's scale and
+	 * child_surface is scaled back to the logical size, see panel.c
+	 */
+	struct wp_fractional_scale_v1 *fractional_scale;
+	struct wp_viewport *child_viewport;
+	/* In 120ths, from wp_fractional_scale_v1; 0 until known */
+	uint32_t preferred_scale;
+	/* From wl_output, for compositors without fractional scaling */
+	int32_t output_scale, pending_output_scale;
+	/* What the nested output was last set to */
+	int mode_width, mode_height;
+	double scale;
+
+	/* Nested output presenting into child_surface */
+	struct wlr_output *wlr_output;
+	struct wlr_scene_output *scene_output;
+	struct wl_listener output_frame;
+	struct wl_listener output_present;
+
+	/* See frame-clock.c */
+	struct {
+		struct wl_callback *callback;
+		bool remote_paced;
+		struct wl_event_source *occlusion_timer;
+	} frame_clock;
+
+	/* Not presented by the remote compositor, for example when covered */
+	bool occluded;
+	/* Shrunk to a strip with --autohide */
+	bool autohidden;
+	/* main_surface has state, like subsurface positions, waiting for a commit */
+	bool needs_commit;
+	struct wl_event_source *autohide_timer;
+
+	/* Last scene commit, for matching against the present event */
+	struct timespec scene_commit_time;
+	uint32_t scene_commit_seq;
+
+	/* Cached background of main_surface, see render.c */
+	struct {
+		struct wl_buffer *buffer;
+		bool busy;
+		struct wp_viewport *viewport;
+		uint32_t color;
+		int width, height;
+		struct wl_callback *frame_callback;
+		bool needs_redraw;
+	} background;
+
+	struct {
+		struct wl_egl_window *window;
+		EGLSurface surface;
+	} egl;
+
+	struct wl_list link; /* server.panels */
+};
+
+/*
+ * Latencies are counted in power-of-two buckets, starting with everything
+ * below 0.125ms in bucket zero and ending with everything above 2s in the
+ * last one.
+ */
+#define HISTOGRAM_BUCKETS (16)
+
+struct histogram {
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+	uint64_t count;
+	uint64_t sum_nsec;
+	uint64_t max_nsec;
+};
+
+struct stats {
+	/* Nested output frames which resulted in a commit */
+	uint64_t output_commits;
+	/* Nested output frames where the scene had nothing new to show */
+	uint64_t output_commits_skipped;
+
+	struct histogram scene_to_present;
+	struct histogram background_to_present;
+
+	/* Oldest remote pointer event not yet handed to wlr_seat */
+	struct timespec input_time;
+	bool input_pending;
+	struct histogram input_to_seat;
+
+	/* Taken first thing in main(), for the time to first frame */
+	struct timespec start_time;
+	uint64_t first_commit_nsec;
+	uint64_t first_present_nsec;
+};
+
 struct toplevel {
 	struct server *server;
 	struct wlr_xdg_toplevel *xdg_toplevel;
 	struct wlr_scene_tree *scene_tree;
 
-	struct wlr_box pending;
+	/* Set when buffers are forwarded to the remote compositor */
+	struct passthrough *passthrough;
+
+	/* Set for in-process plugins, which have no xdg_toplevel */
+	struct native *native;
+
+	/* Set for the snapshot keeping the slot of an unmapped plugin */
+	struct ghost *ghost;
+	/* Removed on request, so its slot is not kept */
+	bool removed;
+	/* Hidden while over its shm budget, see shm-budget.c */
+	bool rejected;
+
+	/* Cached layout, see arrange_toplevels() */
+	struct wlr_box geometry;
+	int x;
+
+	/* Frame timing, see stats.c */
+	struct {
+		struct timespec commit_time;
+		bool commit_pending;
+		bool in_flight;
+		/* commit_time of the buffer in flight, as later commits move it on */
+		struct timespec in_flight_commit_time;
+		/* The panel whose commit first included the buffer */
+		struct panel *commit_panel;
+		uint32_t commit_seq;
+		struct histogram commit_to_scene;
+		struct histogram commit_to_present;
+	} timing;
+
+	/* Configure sent for a resize, see transaction.c */
+	struct {
+		uint32_t serial;
+		bool pending;
+	} transaction;
+
+	/* Commit rate accounting and limiting, see xdg-shell.c */
+	struct {
+		pid_t pid;
+		uint64_t commits;
+		uint64_t frame_requests;
+		struct timespec window_start;
+		int window_commits;
+		int last_window_commits;
+		int peak_rate;
+		/* One second windows with more than --max-commit-rate commits */
+		uint64_t windows_over_limit;
+		/* frame_done held back to keep under --max-commit-rate */
+		uint64_t frames_delayed;
+		struct timespec last_frame_done;
+		struct wl_event_source *frame_timer;
+		bool frame_timer_armed;
+	} rate;
 
 	struct wl_listener map;
 	struct wl_listener unmap;
@@ -92,25 +288,273 @@ struct toplevel {
 	struct wl_list link; /* server.toplevels */
 };
 
+struct supervisor {
+	struct wl_list plugins; /* plugin_process.link */
+	struct wl_event_source *sigchld;
+
+	/* Frames are held back until all plugins have mapped or the deadline */
+	struct wl_event_source *startup_deadline;
+	bool startup_complete;
+	struct timespec start_time;
+};
+
+/* See transaction.c */
+struct transaction {
+	/* Frames are held back until all plugins have resized or the timeout */
+	bool pending;
+	struct wl_event_source *timeout;
+};
+
+/* See trace.c */
+enum trace_event {
+	TRACE_REMOTE_POINTER_ENTER,
+	TRACE_REMOTE_POINTER_LEAVE,
+	TRACE_REMOTE_POINTER_MOTION,
+	TRACE_REMOTE_POINTER_BUTTON,
+	TRACE_REMOTE_POINTER_FRAME,
+	TRACE_REMOTE_CONFIGURE,
+	TRACE_REMOTE_FRAME_DONE,
+	TRACE_REMOTE_PRESENTED,
+	TRACE_INPUT_DELIVERED,
+	TRACE_PLUGIN_COMMIT,
+	TRACE_PLUGIN_FRAME_DONE_DELAYED,
+	TRACE_NATIVE_DRAW,
+	TRACE_LAYOUT,
+	TRACE_TRANSACTION_BEGIN,
+	TRACE_TRANSACTION_END,
+	TRACE_OUTPUT_FRAME,
+	TRACE_SCENE_COMMIT,
+	TRACE_MAIN_SURFACE_COMMIT,
+	TRACE_FRAME_DONE,
+	TRACE_EVENT_COUNT,
+};
+
+extern bool trace_enabled;
+void trace_record(enum trace_event event, char phase, uint32_t arg);
+
+/* Trace points only cost a branch unless --trace is given */
+static inline void
+trace_begin(enum trace_event event, uint32_t arg)
+{
+	if (trace_enabled) {
+		trace_record(event, 'B', arg);
+	}
+}
+
+static inline void
+trace_end(enum trace_event event)
+{
+	if (trace_enabled) {
+		trace_record(event, 'E', 0);
+	}
+}
+
+static inline void
+trace_instant(enum trace_event event, uint32_t arg)
+{
+	if (trace_enabled) {
+		trace_record(event, 'i', arg);
+	}
+}
+
+/* See input-record.c */
+struct input {
+	/* --record-input */
+	FILE *record;
+	struct timespec record_start;
+
+	/* --replay-input, an array of struct input_event */
+	struct wl_array replay_events;
+	size_t replay_next;
+	double replay_speed;
+	struct timespec replay_start;
+	struct wl_event_source *replay_timer;
+};
+
+/* See shm-budget.c */
+enum shm_budget_policy {
+	SHM_BUDGET_WARN,
+	SHM_BUDGET_REJECT,
+	SHM_BUDGET_DISCONNECT,
+};
+
+struct shm_budget {
+	/* Per client in bytes, 0 for no limit */
+	uint64_t limit;
+	enum shm_budget_policy policy;
+
+	struct wl_list clients; /* shm_client.link */
+	struct wl_listener client_created;
+	struct wl_protocol_logger *logger;
+};
+
+/* See control.c */
+struct control {
+	int fd;
+	char *path;
+	struct wl_event_source *source;
+	struct wl_list clients; /* control_client.link */
+};
+
 struct server {
-	int width;
+	/* Requested panel height; the width follows each remote output */
 	int height;
+	/* Height plugins are configured to, see transaction.c */
+	int plugin_height;
+
+	/* 0xRRGGBBAA */
+	uint32_t background;
+	/* Draw the background with EGL/GLES instead of using a buffer */
+	bool egl_background;
+
+	/* Forward each remote motion event rather than one per pointer frame */
+	bool raw_pointer_motion;
+
+	/* Give each plugin its own remote subsurface, see passthrough.c */
+	bool passthrough;
+
+	/* Commits per second allowed for each plugin, 0 for no limit */
+	int max_commit_rate;
+
+	/* Shrink panels to a strip when the pointer is not on them */
+	bool autohide;
+	/* No panel is visible, so plugins are told to stop drawing */
+	bool suspended;
+
+	struct stats stats;
+	struct supervisor supervisor;
+	struct input input;
+	struct shm_budget shm_budget;
+	struct transaction transaction;
+	struct control control;
 
 	struct frontend *frontend;
 	struct backend *backend;
+	struct wl_list panels; /* panel.link */
 
 	struct wlr_scene *scene;
 
 	struct wlr_xdg_shell *xdg_shell;
 	struct wl_listener new_xdg_toplevel;
 	struct wl_list toplevels;
+
+	/* Mapped toplevels sorted by x, see toplevel_index_lookup() */
+	struct wl_array toplevel_index;
 };
 
-void render(struct server *server);
+void control_init(struct server *server, struct wl_event_loop *event_loop);
+void control_finish(struct server *server);
+bool ghost_create(struct toplevel *toplevel);
+bool ghost_claim(struct toplevel *toplevel);
+void ghost_release(struct toplevel *toplevel);
+const char *ghost_app_id(struct toplevel *toplevel);
+void frame_clock_init(struct panel *panel);
+void frame_clock_finish(struct panel *panel);
+bool input_record_open(struct server *server, const char *path);
+void input_record_motion(struct server *server, uint32_t time, wl_fixed_t x,
+	wl_fixed_t y);
+void input_record_button(struct server *server, uint32_t time, uint32_t button,
+	uint32_t state);
+void input_record_frame(struct server *server);
+bool input_replay_open(struct server *server, const char *arg);
+void input_replay_start(struct server *server);
+void input_finish(struct server *server);
+void layout_init(struct server *server);
+void layout_add(struct toplevel *toplevel);
+void layout_remove(struct toplevel *toplevel);
+void layout_replace(struct toplevel *old, struct toplevel *toplevel);
+void layout_move(struct toplevel *toplevel, int index);
+void layout_set_geometry(struct toplevel *toplevel, const struct wlr_box *geometry);
+const char *toplevel_app_id(struct toplevel *toplevel);
+void native_plugin_load(struct server *server, const char *command);
+void native_plugin_unload(struct toplevel *toplevel);
+const char *native_plugin_name(struct toplevel *toplevel);
+void native_pointer_motion(struct server *server, struct toplevel *toplevel,
+	double lx, double ly);
+void native_pointer_button(struct toplevel *toplevel, double lx, double ly,
+	uint32_t button, bool pressed);
+void native_resume(struct server *server);
+void native_set_height(struct server *server);
+void native_set_scale(struct server *server);
+void passthrough_create(struct toplevel *toplevel);
+void passthrough_destroy(struct toplevel *toplevel);
+void passthrough_deactivate(struct toplevel *toplevel);
+void passthrough_commit(struct toplevel *toplevel);
+void passthrough_move(struct toplevel *toplevel);
+void passthrough_panel_destroyed(struct panel *panel);
+bool passthrough_surface_at(struct toplevel *toplevel, double lx, double ly,
+	struct wlr_surface **surface, double *sx, double *sy);
+void render_schedule(struct server *server);
+void render_panel_schedule(struct panel *panel);
+void render_panel_commit(struct panel *panel);
+void render_panel_finish(struct panel *panel);
+void render_set_background(struct server *server, uint32_t rgba);
+void shm_budget_init(struct server *server, struct wl_display *local_display);
+bool shm_budget_parse(struct server *server, const char *arg);
+void shm_budget_dump(struct server *server, FILE *stream);
+bool shm_client_over_budget(struct server *server, struct wl_client *client);
+void stats_init(struct server *server, struct wl_event_loop *event_loop);
+void stats_dump(struct server *server, FILE *stream);
+void stats_toplevel_commit(struct toplevel *toplevel);
+void stats_scene_commit(struct panel *panel);
+void stats_scene_present(struct panel *panel, uint32_t commit_seq,
+	const struct timespec *when);
+bool stats_presentation_time(struct server *server, struct timespec *when);
+void stats_panel_destroyed(struct panel *panel);
+void stats_input_event(struct server *server);
+void stats_input_delivered(struct server *server);
+void stats_input_discard(struct server *server);
+void histogram_add(struct histogram *histogram, const struct timespec *start,
+	const struct timespec *end);
+void supervisor_init(struct server *server);
+void supervisor_add(struct server *server, const char *command);
+bool supervisor_launch(struct server *server, const char *command);
+bool supervisor_remove(struct server *server, pid_t pid);
+void supervisor_start(struct server *server);
+void supervisor_wait(struct server *server, int startup_deadline_ms);
+void supervisor_toplevel_mapped(struct server *server, struct wl_client *client);
+void supervisor_dump(struct server *server, FILE *stream);
+void supervisor_finish(struct server *server);
+bool trace_open(const char *arg);
+void trace_init(struct wl_event_loop *event_loop);
+void trace_export(void);
+void trace_finish(void);
+void transaction_init(struct server *server, struct wl_event_loop *event_loop);
+void transaction_panels_resized(struct server *server);
+void transaction_configure_new(struct toplevel *toplevel);
+void transaction_toplevel_commit(struct toplevel *toplevel);
+void transaction_toplevel_unmap(struct toplevel *toplevel);
+void transaction_clip(struct toplevel *toplevel);
 void xdg_shell_init(struct server *server, struct wl_display *local_display);
+void xdg_shell_set_suspended(struct server *server, bool suspended);
+void xdg_shell_set_rejected(struct server *server, struct wl_client *client,
+	bool rejected);
+void toplevel_set_rejected(struct toplevel *toplevel, bool rejected);
+int toplevel_commit_rate(struct toplevel *toplevel);
+bool toplevel_frame_done_allowed(struct toplevel *toplevel, const struct timespec *now);
+struct toplevel *toplevel_from_node(struct server *server, struct wlr_scene_node *node);
+struct toplevel *toplevel_index_lookup(struct server *server, double lx);
 
-void backend_layer_shell_init(struct backend *backend);
+void seat_pointer_motion(struct seat *seat, uint32_t time, wl_fixed_t surface_x,
+	wl_fixed_t surface_y);
+void seat_pointer_button(struct seat *seat, uint32_t time, uint32_t button,
+	uint32_t state);
+void seat_pointer_frame(struct seat *seat);
+void panel_add(struct server *server, uint32_t global_name,
+	struct wl_output *wl_output);
+void panel_remove(struct server *server, uint32_t global_name);
+void panel_start(struct server *server);
+void panel_schedule_frame(struct server *server);
+struct panel *panel_primary(struct server *server);
+void panel_set_occluded(struct panel *panel, bool occluded);
+void panel_pointer_enter(struct server *server, struct wl_surface *surface);
+void panel_pointer_leave(struct server *server, struct wl_surface *surface);
+void panel_set_height(struct server *server, int height);
+void panel_finish(struct server *server);
+bool parse_int(const char *str, int *value);
+bool parse_color(const char *str, uint32_t *rgba);
 void backend_init(struct server *server, struct backend *backend);
+void backend_wait_globals(struct backend *backend);
 void backend_finish(struct backend *backend);
 
 #endif /* CARTHUSIAN_PANEL_H */
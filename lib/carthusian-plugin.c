@@ -0,0 +1,580 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include "carthusian-plugin.h"
+#include "xdg-shell-client-protocol.h"
+
+#define MAX_BUFFERS (3)
+
+struct buffer {
+	struct carthusian_plugin *plugin;
+	struct wl_buffer *wl_buffer;
+	uint32_t *data;
+	bool busy;
+};
+
+struct carthusian_plugin {
+	const struct carthusian_plugin_listener *listener;
+	void *data;
+
+	struct wl_display *display;
+	struct wl_compositor *compositor;
+	struct wl_shm *shm;
+	struct wl_seat *seat;
+	struct wl_pointer *pointer;
+	struct xdg_wm_base *xdg_wm_base;
+
+	struct wl_surface *surface;
+	struct xdg_surface *xdg_surface;
+	struct xdg_toplevel *xdg_toplevel;
+	bool configured;
+	bool closed;
+
+	int width, height, stride;
+	int nr_buffers;
+	struct buffer buffers[MAX_BUFFERS];
+	/* The buffer most recently committed, whose content is up-to-date */
+	struct buffer *front;
+	void *pool_data;
+	size_t pool_size;
+
+	/* Pending damage as a single bounding box */
+	bool dirty;
+	int damage_x1, damage_y1, damage_x2, damage_y2;
+	struct wl_callback *frame_callback;
+
+	int timer_fd;
+	void (*timer_callback)(void *data);
+	void *timer_data;
+
+	double pointer_x, pointer_y;
+};
+
+static void redraw(struct carthusian_plugin *plugin);
+
+static int
+create_shm_file(size_t size)
+{
+	char name[64];
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	for (int retries = 100; retries > 0; retries--) {
+		snprintf(name, sizeof(name), "/carthusian-plugin-%ld-%ld",
+			(long)getpid(), ts.tv_nsec + retries);
+		int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd >= 0) {
+			shm_unlink(name);
+			if (ftruncate(fd, size) < 0) {
+				close(fd);
+				return -1;
+			}
+			return fd;
+		}
+		if (errno != EEXIST) {
+			break;
+		}
+	}
+	return -1;
+}
+
+static void
+buffer_handle_release(void *data, struct wl_buffer *wl_buffer)
+{
+	struct buffer *buffer = data;
+	buffer->busy = false;
+	if (buffer->plugin->dirty) {
+		redraw(buffer->plugin);
+	}
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+	.release = buffer_handle_release,
+};
+
+static void
+destroy_buffers(struct carthusian_plugin *plugin)
+{
+	for (int i = 0; i < plugin->nr_buffers; i++) {
+		if (plugin->buffers[i].wl_buffer) {
+			wl_buffer_destroy(plugin->buffers[i].wl_buffer);
+		}
+		plugin->buffers[i] = (struct buffer){0};
+	}
+	if (plugin->pool_data) {
+		munmap(plugin->pool_data, plugin->pool_size);
+		plugin->pool_data = NULL;
+	}
+	plugin->front = NULL;
+}
+
+/* All buffers live in one pool, which is only re-created on resize */
+static bool
+create_buffers(struct carthusian_plugin *plugin)
+{
+	plugin->stride = plugin->width * 4;
+	size_t buffer_size = (size_t)plugin->stride * plugin->height;
+	plugin->pool_size = buffer_size * plugin->nr_buffers;
+
+	int fd = create_shm_file(plugin->pool_size);
+	if (fd < 0) {
+		return false;
+	}
+	plugin->pool_data = mmap(NULL, plugin->pool_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	if (plugin->pool_data == MAP_FAILED) {
+		plugin->pool_data = NULL;
+		close(fd);
+		return false;
+	}
+	struct wl_shm_pool *pool = wl_shm_create_pool(plugin->shm, fd, plugin->pool_size);
+	for (int i = 0; i < plugin->nr_buffers; i++) {
+		struct buffer *buffer = &plugin->buffers[i];
+		buffer->plugin = plugin;
+		buffer->data = (uint32_t *)((char *)plugin->pool_data + i * buffer_size);
+		buffer->wl_buffer = wl_shm_pool_create_buffer(pool, i * buffer_size,
+			plugin->width, plugin->height, plugin->stride,
+			WL_SHM_FORMAT_ARGB8888);
+		wl_buffer_add_listener(buffer->wl_buffer, &buffer_listener, buffer);
+	}
+	wl_shm_pool_destroy(pool);
+	close(fd);
+	return true;
+}
+
+static struct buffer *
+get_free_buffer(struct carthusian_plugin *plugin)
+{
+	for (int i = 0; i < plugin->nr_buffers; i++) {
+		if (!plugin->buffers[i].busy) {
+			return &plugin->buffers[i];
+		}
+	}
+	return NULL;
+}
+
+static void
+frame_handle_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	struct carthusian_plugin *plugin = data;
+	wl_callback_destroy(callback);
+	plugin->frame_callback = NULL;
+	if (plugin->dirty) {
+		redraw(plugin);
+	}
+}
+
+static const struct wl_callback_listener frame_listener = {
+	.done = frame_handle_done,
+};
+
+static void
+redraw(struct carthusian_plugin *plugin)
+{
+	if (!plugin->configured || plugin->frame_callback) {
+		/* Will be drawn once configured or on the next frame callback */
+		return;
+	}
+	if (!plugin->pool_data && !create_buffers(plugin)) {
+		fprintf(stderr, "carthusian-plugin: cannot allocate buffers\n");
+		return;
+	}
+	struct buffer *buffer = get_free_buffer(plugin);
+	if (!buffer) {
+		/* Will be drawn when the compositor releases one */
+		return;
+	}
+
+	/* Bring the buffer up-to-date so that only the damage needs drawing */
+	if (plugin->front && plugin->front != buffer) {
+		memcpy(buffer->data, plugin->front->data,
+			(size_t)plugin->stride * plugin->height);
+	}
+
+	struct carthusian_plugin_buffer b = {
+		.data = buffer->data,
+		.width = plugin->width,
+		.height = plugin->height,
+		.stride = plugin->stride,
+	};
+	plugin->listener->draw(plugin->data, plugin, &b);
+
+	wl_surface_attach(plugin->surface, buffer->wl_buffer, 0, 0);
+	wl_surface_damage_buffer(plugin->surface, plugin->damage_x1, plugin->damage_y1,
+		plugin->damage_x2 - plugin->damage_x1,
+		plugin->damage_y2 - plugin->damage_y1);
+	plugin->frame_callback = wl_surface_frame(plugin->surface);
+	wl_callback_add_listener(plugin->frame_callback, &frame_listener, plugin);
+	wl_surface_commit(plugin->surface);
+
+	buffer->busy = true;
+	plugin->front = buffer;
+	plugin->dirty = false;
+}
+
+void
+carthusian_plugin_damage(struct carthusian_plugin *plugin, int x, int y,
+		int width, int height)
+{
+	int x2 = x + width;
+	int y2 = y + height;
+	x = x < 0 ? 0 : x;
+	y = y < 0 ? 0 : y;
+	x2 = x2 > plugin->width ? plugin->width : x2;
+	y2 = y2 > plugin->height ? plugin->height : y2;
+	if (x >= x2 || y >= y2) {
+		return;
+	}
+	if (!plugin->dirty) {
+		plugin->damage_x1 = x;
+		plugin->damage_y1 = y;
+		plugin->damage_x2 = x2;
+		plugin->damage_y2 = y2;
+	} else {
+		plugin->damage_x1 = x < plugin->damage_x1 ? x : plugin->damage_x1;
+		plugin->damage_y1 = y < plugin->damage_y1 ? y : plugin->damage_y1;
+		plugin->damage_x2 = x2 > plugin->damage_x2 ? x2 : plugin->damage_x2;
+		plugin->damage_y2 = y2 > plugin->damage_y2 ? y2 : plugin->damage_y2;
+	}
+	plugin->dirty = true;
+	redraw(plugin);
+}
+
+static void
+resize(struct carthusian_plugin *plugin, int width, int height)
+{
+	if (width == plugin->width && height == plugin->height) {
+		return;
+	}
+	destroy_buffers(plugin);
+	plugin->width = width;
+	plugin->height = height;
+	if (plugin->listener->configure) {
+		plugin->listener->configure(plugin->data, plugin, width, height);
+	}
+	plugin->dirty = false;
+	carthusian_plugin_damage(plugin, 0, 0, width, height);
+}
+
+static void
+xdg_surface_handle_configure(void *data, struct xdg_surface *xdg_surface,
+		uint32_t serial)
+{
+	struct carthusian_plugin *plugin = data;
+	xdg_surface_ack_configure(xdg_surface, serial);
+	if (!plugin->configured) {
+		plugin->configured = true;
+		plugin->dirty = false;
+		carthusian_plugin_damage(plugin, 0, 0, plugin->width, plugin->height);
+	}
+}
+
+static const struct xdg_surface_listener xdg_surface_listener = {
+	.configure = xdg_surface_handle_configure,
+};
+
+static void
+xdg_toplevel_handle_configure(void *data, struct xdg_toplevel *xdg_toplevel,
+		int32_t width, int32_t height, struct wl_array *states)
+{
+	struct carthusian_plugin *plugin = data;
+	/* Zero means that we get to choose */
+	if (width > 0 && height > 0) {
+		resize(plugin, width, height);
+	}
+}
+
+static void
+xdg_toplevel_handle_close(void *data, struct xdg_toplevel *xdg_toplevel)
+{
+	carthusian_plugin_close(data);
+}
+
+static const struct xdg_toplevel_listener xdg_toplevel_listener = {
+	.configure = xdg_toplevel_handle_configure,
+	.close = xdg_toplevel_handle_close,
+};
+
+static void
+xdg_wm_base_handle_ping(void *data, struct xdg_wm_base *xdg_wm_base, uint32_t serial)
+{
+	xdg_wm_base_pong(xdg_wm_base, serial);
+}
+
+static const struct xdg_wm_base_listener xdg_wm_base_listener = {
+	.ping = xdg_wm_base_handle_ping,
+};
+
+static void
+pointer_handle_enter(void *data, struct wl_pointer *wl_pointer, uint32_t serial,
+		struct wl_surface *surface, wl_fixed_t x, wl_fixed_t y)
+{
+	struct carthusian_plugin *plugin = data;
+	plugin->pointer_x = wl_fixed_to_double(x);
+	plugin->pointer_y = wl_fixed_to_double(y);
+}
+
+static void
+pointer_handle_leave(void *data, struct wl_pointer *wl_pointer, uint32_t serial,
+		struct wl_surface *surface)
+{
+	/* no-op */
+}
+
+static void
+pointer_handle_motion(void *data, struct wl_pointer *wl_pointer, uint32_t time,
+		wl_fixed_t x, wl_fixed_t y)
+{
+	struct carthusian_plugin *plugin = data;
+	plugin->pointer_x = wl_fixed_to_double(x);
+	plugin->pointer_y = wl_fixed_to_double(y);
+}
+
+static void
+pointer_handle_button(void *data, struct wl_pointer *wl_pointer, uint32_t serial,
+		uint32_t time, uint32_t button, uint32_t state)
+{
+	struct carthusian_plugin *plugin = data;
+	if (plugin->listener->pointer_button) {
+		plugin->listener->pointer_button(plugin->data, plugin, plugin->pointer_x,
+			plugin->pointer_y, button, state == WL_POINTER_BUTTON_STATE_PRESSED);
+	}
+}
+
+static void
+pointer_handle_axis(void *data, struct wl_pointer *wl_pointer, uint32_t time,
+		uint32_t axis, wl_fixed_t value)
+{
+	/* no-op */
+}
+
+/* Only version 1 of wl_seat is bound, so later events never arrive */
+static const struct wl_pointer_listener pointer_listener = {
+	.enter = pointer_handle_enter,
+	.leave = pointer_handle_leave,
+	.motion = pointer_handle_motion,
+	.button = pointer_handle_button,
+	.axis = pointer_handle_axis,
+};
+
+static void
+seat_handle_capabilities(void *data, struct wl_seat *wl_seat, uint32_t caps)
+{
+	struct carthusian_plugin *plugin = data;
+	bool has_pointer = caps & WL_SEAT_CAPABILITY_POINTER;
+	if (has_pointer && !plugin->pointer) {
+		plugin->pointer = wl_seat_get_pointer(wl_seat);
+		wl_pointer_add_listener(plugin->pointer, &pointer_listener, plugin);
+	} else if (!has_pointer && plugin->pointer) {
+		wl_pointer_destroy(plugin->pointer);
+		plugin->pointer = NULL;
+	}
+}
+
+static const struct wl_seat_listener seat_listener = {
+	.capabilities = seat_handle_capabilities,
+};
+
+static void
+handle_global(void *data, struct wl_registry *registry, uint32_t name,
+		const char *interface, uint32_t version)
+{
+	struct carthusian_plugin *plugin = data;
+
+	if (!strcmp(interface, wl_compositor_interface.name)) {
+		plugin->compositor = wl_registry_bind(registry, name,
+			&wl_compositor_interface, 4);
+	} else if (!strcmp(interface, wl_shm_interface.name)) {
+		plugin->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+	} else if (!strcmp(interface, xdg_wm_base_interface.name)) {
+		plugin->xdg_wm_base = wl_registry_bind(registry, name,
+			&xdg_wm_base_interface, 1);
+		xdg_wm_base_add_listener(plugin->xdg_wm_base, &xdg_wm_base_listener, plugin);
+	} else if (!strcmp(interface, wl_seat_interface.name) && !plugin->seat) {
+		plugin->seat = wl_registry_bind(registry, name, &wl_seat_interface, 1);
+		wl_seat_add_listener(plugin->seat, &seat_listener, plugin);
+	}
+}
+
+static void
+handle_global_remove(void *data, struct wl_registry *registry, uint32_t name)
+{
+	/* no-op */
+}
+
+static const struct wl_registry_listener registry_listener = {
+	.global = handle_global,
+	.global_remove = handle_global_remove,
+};
+
+struct carthusian_plugin *
+carthusian_plugin_create(const char *app_id, int width, int height, int nr_buffers,
+		const struct carthusian_plugin_listener *listener, void *data)
+{
+	struct carthusian_plugin *plugin = calloc(1, sizeof(*plugin));
+	if (!plugin) {
+		return NULL;
+	}
+	plugin->listener = listener;
+	plugin->data = data;
+	plugin->width = width;
+	plugin->height = height;
+	plugin->nr_buffers = nr_buffers < 2 ? 2 : nr_buffers > MAX_BUFFERS ? MAX_BUFFERS : nr_buffers;
+	plugin->timer_fd = -1;
+
+	plugin->display = wl_display_connect(NULL);
+	if (!plugin->display) {
+		fprintf(stderr, "carthusian-plugin: cannot connect to display\n");
+		free(plugin);
+		return NULL;
+	}
+	struct wl_registry *registry = wl_display_get_registry(plugin->display);
+	wl_registry_add_listener(registry, &registry_listener, plugin);
+	wl_display_roundtrip(plugin->display);
+	wl_registry_destroy(registry);
+	if (!plugin->compositor || !plugin->shm || !plugin->xdg_wm_base) {
+		fprintf(stderr, "carthusian-plugin: missing required globals\n");
+		carthusian_plugin_destroy(plugin);
+		return NULL;
+	}
+
+	plugin->surface = wl_compositor_create_surface(plugin->compositor);
+	plugin->xdg_surface = xdg_wm_base_get_xdg_surface(plugin->xdg_wm_base,
+		plugin->surface);
+	xdg_surface_add_listener(plugin->xdg_surface, &xdg_surface_listener, plugin);
+	plugin->xdg_toplevel = xdg_surface_get_toplevel(plugin->xdg_surface);
+	xdg_toplevel_add_listener(plugin->xdg_toplevel, &xdg_toplevel_listener, plugin);
+	xdg_toplevel_set_app_id(plugin->xdg_toplevel, app_id);
+	wl_surface_commit(plugin->surface);
+	return plugin;
+}
+
+void
+carthusian_plugin_destroy(struct carthusian_plugin *plugin)
+{
+	if (plugin->timer_fd >= 0) {
+		close(plugin->timer_fd);
+	}
+	if (plugin->frame_callback) {
+		wl_callback_destroy(plugin->frame_callback);
+	}
+	destroy_buffers(plugin);
+	if (plugin->xdg_toplevel) {
+		xdg_toplevel_destroy(plugin->xdg_toplevel);
+		xdg_surface_destroy(plugin->xdg_surface);
+		wl_surface_destroy(plugin->surface);
+	}
+	if (plugin->pointer) {
+		wl_pointer_destroy(plugin->pointer);
+	}
+	if (plugin->seat) {
+		wl_seat_destroy(plugin->seat);
+	}
+	if (plugin->xdg_wm_base) {
+		xdg_wm_base_destroy(plugin->xdg_wm_base);
+	}
+	if (plugin->shm) {
+		wl_shm_destroy(plugin->shm);
+	}
+	if (plugin->compositor) {
+		wl_compositor_destroy(plugin->compositor);
+	}
+	wl_display_disconnect(plugin->display);
+	free(plugin);
+}
+
+bool
+carthusian_plugin_set_timer(struct carthusian_plugin *plugin, int interval_ms,
+		void (*callback)(void *data), void *data)
+{
+	if (plugin->timer_fd < 0) {
+		plugin->timer_fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+		if (plugin->timer_fd < 0) {
+			return false;
+		}
+	}
+	plugin->timer_callback = callback;
+	plugin->timer_data = data;
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	int64_t interval_ns = (int64_t)interval_ms * 1000000;
+	int64_t now_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	int64_t next_ns = (now_ns / interval_ns + 1) * interval_ns;
+	struct itimerspec spec = {
+		.it_interval = {
+			.tv_sec = interval_ns / 1000000000,
+			.tv_nsec = interval_ns % 1000000000,
+		},
+		.it_value = {
+			.tv_sec = next_ns / 1000000000,
+			.tv_nsec = next_ns % 1000000000,
+		},
+	};
+	return timerfd_settime(plugin->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == 0;
+}
+
+void
+carthusian_plugin_close(struct carthusian_plugin *plugin)
+{
+	plugin->closed = true;
+}
+
+int
+carthusian_plugin_run(struct carthusian_plugin *plugin)
+{
+	struct pollfd fds[2] = {
+		{ .fd = wl_display_get_fd(plugin->display), .events = POLLIN },
+		{ .fd = plugin->timer_fd, .events = POLLIN },
+	};
+
+	while (!plugin->closed) {
+		while (wl_display_prepare_read(plugin->display) != 0) {
+			if (wl_display_dispatch_pending(plugin->display) < 0) {
+				return -1;
+			}
+		}
+		if (wl_display_flush(plugin->display) < 0 && errno != EAGAIN) {
+			wl_display_cancel_read(plugin->display);
+			return -1;
+		}
+
+		fds[1].fd = plugin->timer_fd;
+		if (poll(fds, 2, -1) < 0) {
+			wl_display_cancel_read(plugin->display);
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			if (wl_display_read_events(plugin->display) < 0) {
+				return -1;
+			}
+		} else {
+			wl_display_cancel_read(plugin->display);
+		}
+		if (wl_display_dispatch_pending(plugin->display) < 0) {
+			return -1;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			uint64_t expirations;
+			if (read(plugin->timer_fd, &expirations, sizeof(expirations)) > 0) {
+				plugin->timer_callback(plugin->timer_data);
+			}
+		}
+		if (fds[0].revents & (POLLERR | POLLHUP)) {
+			return -1;
+		}
+	}
+	return 0;
+}
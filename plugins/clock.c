@@ -0,0 +1,238 @@
+/*
+ * Reference clock plugin written against libcarthusian-plugin. It does the
+ * same as clock.py, but only wakes up once a second and only redraws the
+ * digits which have changed.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "carthusian-plugin.h"
+
+#define WIDTH (100)
+#define HEIGHT (30)
+
+#define GLYPH_WIDTH (5)
+#define GLYPH_HEIGHT (7)
+#define GLYPH_SCALE (2)
+#define GLYPH_ADVANCE ((GLYPH_WIDTH + 1) * GLYPH_SCALE)
+
+#define TEXT_LENGTH (8)
+
+/* 5x7 bitmaps for "0123456789:", one byte per row with the MSB on the left */
+static const unsigned char glyphs[11][GLYPH_HEIGHT] = {
+	{ 0x70, 0x88, 0x98, 0xa8, 0xc8, 0x88, 0x70 },
+	{ 0x20, 0x60, 0x20, 0x20, 0x20, 0x20, 0x70 },
+	{ 0x70, 0x88, 0x08, 0x10, 0x20, 0x40, 0xf8 },
+	{ 0xf8, 0x10, 0x20, 0x10, 0x08, 0x88, 0x70 },
+	{ 0x10, 0x30, 0x50, 0x90, 0xf8, 0x10, 0x10 },
+	{ 0xf8, 0x80, 0xf0, 0x08, 0x08, 0x88, 0x70 },
+	{ 0x30, 0x40, 0x80, 0xf0, 0x88, 0x88, 0x70 },
+	{ 0xf8, 0x08, 0x10, 0x20, 0x40, 0x40, 0x40 },
+	{ 0x70, 0x88, 0x88, 0x70, 0x88, 0x88, 0x70 },
+	{ 0x70, 0x88, 0x88, 0x78, 0x08, 0x10, 0x60 },
+	{ 0x00, 0x60, 0x60, 0x00, 0x60, 0x60, 0x00 },
+};
+
+struct clock {
+	struct carthusian_plugin *plugin;
+	uint32_t background;
+	uint32_t foreground;
+	int width, height;
+
+	/* Text currently drawn and the text to draw next */
+	char drawn[TEXT_LENGTH + 1];
+	char text[TEXT_LENGTH + 1];
+	bool background_drawn;
+};
+
+static int
+text_x(struct clock *clock)
+{
+	return (clock->width - (TEXT_LENGTH * GLYPH_ADVANCE - GLYPH_SCALE)) / 2;
+}
+
+static int
+text_y(struct clock *clock)
+{
+	return (clock->height - GLYPH_HEIGHT * GLYPH_SCALE) / 2;
+}
+
+static void
+fill(struct carthusian_plugin_buffer *buffer, int x, int y, int width, int height,
+		uint32_t color)
+{
+	for (int j = y; j < y + height && j < buffer->height; j++) {
+		uint32_t *row = (uint32_t *)((char *)buffer->data + j * buffer->stride);
+		for (int i = x; i < x + width && i < buffer->width; i++) {
+			row[i] = color;
+		}
+	}
+}
+
+static void
+draw_glyph(struct clock *clock, struct carthusian_plugin_buffer *buffer, int x, int y,
+		char c)
+{
+	fill(buffer, x, y, GLYPH_ADVANCE, GLYPH_HEIGHT * GLYPH_SCALE, clock->background);
+	int index = c == ':' ? 10 : c - '0';
+	if (index < 0 || index > 10) {
+		return;
+	}
+	for (int row = 0; row < GLYPH_HEIGHT; row++) {
+		for (int col = 0; col < GLYPH_WIDTH; col++) {
+			if (glyphs[index][row] & (0x80 >> col)) {
+				fill(buffer, x + col * GLYPH_SCALE, y + row * GLYPH_SCALE,
+					GLYPH_SCALE, GLYPH_SCALE, clock->foreground);
+			}
+		}
+	}
+}
+
+static void
+handle_draw(void *data, struct carthusian_plugin *plugin,
+		struct carthusian_plugin_buffer *buffer)
+{
+	struct clock *clock = data;
+	if (!clock->background_drawn) {
+		fill(buffer, 0, 0, buffer->width, buffer->height, clock->background);
+		clock->background_drawn = true;
+		memset(clock->drawn, 0, sizeof(clock->drawn));
+	}
+	for (int i = 0; i < TEXT_LENGTH; i++) {
+		if (clock->text[i] != clock->drawn[i]) {
+			draw_glyph(clock, buffer, text_x(clock) + i * GLYPH_ADVANCE,
+				text_y(clock), clock->text[i]);
+		}
+	}
+	memcpy(clock->drawn, clock->text, sizeof(clock->drawn));
+}
+
+static void
+handle_configure(void *data, struct carthusian_plugin *plugin, int width, int height)
+{
+	struct clock *clock = data;
+	clock->width = width;
+	clock->height = height;
+	clock->background_drawn = false;
+}
+
+static void
+handle_pointer_button(void *data, struct carthusian_plugin *plugin, double x,
+		double y, uint32_t button, bool pressed)
+{
+	/* Like clock.py, close on click */
+	if (pressed) {
+		carthusian_plugin_close(plugin);
+	}
+}
+
+static const struct carthusian_plugin_listener listener = {
+	.draw = handle_draw,
+	.configure = handle_configure,
+	.pointer_button = handle_pointer_button,
+};
+
+static void
+update_time(void *data)
+{
+	struct clock *clock = data;
+	time_t now = time(NULL);
+	struct tm tm;
+	localtime_r(&now, &tm);
+	strftime(clock->text, sizeof(clock->text), "%H:%M:%S", &tm);
+
+	/* Only damage the span of characters which changed */
+	int first = -1, last = -1;
+	for (int i = 0; i < TEXT_LENGTH; i++) {
+		if (clock->text[i] != clock->drawn[i]) {
+			if (first < 0) {
+				first = i;
+			}
+			last = i;
+		}
+	}
+	if (first < 0) {
+		return;
+	}
+	carthusian_plugin_damage(clock->plugin, text_x(clock) + first * GLYPH_ADVANCE,
+		text_y(clock), (last - first + 1) * GLYPH_ADVANCE,
+		GLYPH_HEIGHT * GLYPH_SCALE);
+}
+
+static uint32_t
+parse_color(const char *name)
+{
+	static const struct {
+		const char *name;
+		uint32_t argb;
+	} colors[] = {
+		{ "red", 0xffff0000 },
+		{ "green", 0xff008000 },
+		{ "blue", 0xff0000ff },
+		{ "white", 0xffffffff },
+		{ "black", 0xff000000 },
+	};
+	for (size_t i = 0; i < sizeof(colors) / sizeof(colors[0]); i++) {
+		if (!strcmp(name, colors[i].name)) {
+			return colors[i].argb;
+		}
+	}
+	if (name[0] == '#' && strlen(name) == 7) {
+		return 0xff000000 | strtoul(name + 1, NULL, 16);
+	}
+	fprintf(stderr, "clock: unknown color '%s'\n", name);
+	return 0xffefefef;
+}
+
+static const struct option long_options[] = {
+	{"color", required_argument, NULL, 'c'},
+	{"help", no_argument, NULL, 'h'},
+	{0, 0, 0, 0}
+};
+
+static const char usage[] =
+"Usage: clock [options...]\n"
+"  -c, --color <color>   Background color by name or as #rrggbb\n"
+"  -h, --help            Show help message and quit\n";
+
+int
+main(int argc, char **argv)
+{
+	struct clock clock = {
+		.background = 0xffefefef,
+		.foreground = 0xff000000,
+		.width = WIDTH,
+		.height = HEIGHT,
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "c:h", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'c':
+			clock.background = parse_color(optarg);
+			break;
+		case 'h':
+			printf("%s", usage);
+			exit(EXIT_SUCCESS);
+		default:
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	clock.plugin = carthusian_plugin_create("carthusian-clock", WIDTH, HEIGHT, 2,
+		&listener, &clock);
+	if (!clock.plugin) {
+		exit(EXIT_FAILURE);
+	}
+	update_time(&clock);
+	if (!carthusian_plugin_set_timer(clock.plugin, 1000, update_time, &clock)) {
+		fprintf(stderr, "clock: cannot create timer\n");
+		exit(EXIT_FAILURE);
+	}
+	int ret = carthusian_plugin_run(clock.plugin);
+	carthusian_plugin_destroy(clock.plugin);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,60 +1,9 @@
 #include "panel.h"
 
-static struct zwlr_layer_surface_v1 *layer_surface;
-static struct zwlr_layer_shell_v1 *layer_shell;
-static struct wl_output *wl_output;
-
 static struct wl_cursor_image *cursor_image;
 static struct wl_surface *cursor_surface;
 static struct wl_cursor_theme *cursor_theme;
 
-static void
-layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *layer_surface,
-		uint32_t serial, uint32_t width, uint32_t height)
-{
-	struct server *server = data;
-	server->width = width;
-	server->height = height;
-	if (server->backend->egl.window) {
-		wl_egl_window_resize(server->backend->egl.window, width, height, 0, 0);
-	}
-	zwlr_layer_surface_v1_ack_configure(layer_surface, serial);
-	render(server);
-}
-
-static void
-layer_surface_closed(void *data, struct zwlr_layer_surface_v1 *layer_surface)
-{
-	zwlr_layer_surface_v1_destroy(layer_surface);
-}
-
-static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
-	.configure = layer_surface_configure,
-	.closed = layer_surface_closed,
-};
-
-void
-backend_layer_shell_init(struct backend *backend)
-{
-	struct server *server = backend->server;
-
-	layer_surface = zwlr_layer_shell_v1_get_layer_surface(layer_shell, backend->main_surface,
-		wl_output, ZWLR_LAYER_SHELL_V1_LAYER_TOP, "carthusian");
-	if (!layer_surface) {
-		fprintf(stderr, "fatal: layer_surface\n");
-		exit(EXIT_FAILURE);
-	}
-	zwlr_layer_surface_v1_set_size(layer_surface, server->width, server->height);
-	zwlr_layer_surface_v1_set_anchor(layer_surface, ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT
-		| ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM | ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT);
-	zwlr_layer_surface_v1_set_exclusive_zone(layer_surface, server->height);
-	zwlr_layer_surface_v1_set_keyboard_interactivity(layer_surface,
-		ZWLR_LAYER_SURFACE_V1_KEYBOARD_INTERACTIVITY_NONE);
-	zwlr_layer_surface_v1_add_listener(layer_surface, &layer_surface_listener, server);
-	wl_surface_commit(backend->main_surface);
-	wl_display_roundtrip(backend->remote_display);
-}
-
 static void
 handle_wl_pointer_enter(void *data, struct wl_pointer *wl_pointer, uint32_t serial,
 		struct wl_surface *surface, wl_fixed_t surface_x,
@@ -62,6 +11,7 @@ handle_wl_pointer_enter(void *data, struct wl_pointer *wl_pointer, uint32_t seri
 {
 	struct seat *seat = data;
 	struct server *server = seat->server;
+	trace_instant(TRACE_REMOTE_POINTER_ENTER, 0);
 
 	struct wl_cursor_image *image = cursor_image;
 	wl_surface_attach(cursor_surface, wl_cursor_image_get_buffer(image), 0, 0);
@@ -69,39 +19,87 @@ handle_wl_pointer_enter(void *data, struct wl_pointer *wl_pointer, uint32_t seri
 	wl_surface_commit(cursor_surface);
 	wl_pointer_set_cursor(wl_pointer, serial, cursor_surface,
 		image->hotspot_x, image->hotspot_y);
+
+	panel_pointer_enter(server, surface);
 }
 
 static void
 handle_wl_pointer_leave(void *data, struct wl_pointer *wl_pointer, uint32_t serial,
 		struct wl_surface *surface)
 {
-	// TODO
+	struct seat *seat = data;
+	trace_instant(TRACE_REMOTE_POINTER_LEAVE, 0);
+	panel_pointer_leave(seat->server, surface);
 }
 
 static void
-handle_wl_pointer_motion(void *data, struct wl_pointer *wl_pointer, uint32_t time,
-		wl_fixed_t surface_x, wl_fixed_t surface_y)
+send_pointer_motion(struct seat *seat, uint32_t time, wl_fixed_t surface_x,
+		wl_fixed_t surface_y)
 {
-	struct seat *seat = data;
-	struct server *server = seat->server;
+	struct frontend *frontend = seat->server->frontend;
+
+	/*
+	 * All nested outputs are at 0,0, so surface coordinates on any panel
+	 * are layout coordinates once scaled to the layout's bounding box
+	 */
+	struct wlr_box box;
+	wlr_output_layout_get_box(frontend->output_layout, NULL, &box);
+	if (wlr_box_empty(&box)) {
+		return;
+	}
 
 	struct wlr_pointer_motion_absolute_event event = {
 		.pointer = &seat->wlr_pointer,
 		.time_msec = time,
-		.x = wl_fixed_to_double(surface_x) / (double)server->width,
-		.y = wl_fixed_to_double(surface_y) / (double)server->height,
+		.x = wl_fixed_to_double(surface_x) / (double)box.width,
+		.y = wl_fixed_to_double(surface_y) / (double)box.height,
 	};
 
-	struct frontend *frontend = seat->server->frontend;
 	wl_signal_emit_mutable(&frontend->cursor->events.motion_absolute, &event);
 }
 
 static void
-handle_wl_pointer_button(void *data, struct wl_pointer *wl_pointer, uint32_t serial,
-		uint32_t time, uint32_t button, uint32_t state)
+flush_pointer_motion(struct seat *seat)
 {
-	fprintf(stderr, "info: '%s()'\n", __func__);
-	struct seat *seat = data;
+	if (!seat->motion.pending) {
+		return;
+	}
+	seat->motion.pending = false;
+	send_pointer_motion(seat, seat->motion.time, seat->motion.x, seat->motion.y);
+}
+
+/*
+ * The seat_pointer_*() functions take remote pointer events, whether they come
+ * from the remote compositor or are replayed by input-record.c
+ */
+void
+seat_pointer_motion(struct seat *seat, uint32_t time, wl_fixed_t surface_x,
+		wl_fixed_t surface_y)
+{
+	stats_input_event(seat->server);
+
+	if (seat->server->raw_pointer_motion) {
+		send_pointer_motion(seat, time, surface_x, surface_y);
+		return;
+	}
+
+	/*
+	 * High polling-rate mice can produce several motion events per frame,
+	 * so only keep the latest position and deliver it on wl_pointer.frame
+	 */
+	seat->motion.pending = true;
+	seat->motion.time = time;
+	seat->motion.x = surface_x;
+	seat->motion.y = surface_y;
+}
+
+void
+seat_pointer_button(struct seat *seat, uint32_t time, uint32_t button,
+		uint32_t state)
+{
+	/* Make sure the button is delivered at the right position */
+	flush_pointer_motion(seat);
+	stats_input_event(seat->server);
 
 	struct wlr_pointer_button_event event = {
 		.pointer = &seat->wlr_pointer,
@@ -119,6 +117,38 @@ handle_wl_pointer_button(void *data, struct wl_pointer *wl_pointer, uint32_t ser
 	wl_signal_emit_mutable(&frontend->cursor->events.button, &event);
 }
 
+void
+seat_pointer_frame(struct seat *seat)
+{
+	flush_pointer_motion(seat);
+	wl_signal_emit_mutable(&seat->wlr_pointer.events.frame, &seat->wlr_pointer);
+	struct frontend *frontend = seat->server->frontend;
+	wl_signal_emit_mutable(&frontend->cursor->events.frame, &frontend->cursor);
+
+	/* Events which did not reach a plugin are not counted */
+	stats_input_discard(seat->server);
+}
+
+static void
+handle_wl_pointer_motion(void *data, struct wl_pointer *wl_pointer, uint32_t time,
+		wl_fixed_t surface_x, wl_fixed_t surface_y)
+{
+	struct seat *seat = data;
+	trace_instant(TRACE_REMOTE_POINTER_MOTION, time);
+	input_record_motion(seat->server, time, surface_x, surface_y);
+	seat_pointer_motion(seat, time, surface_x, surface_y);
+}
+
+static void
+handle_wl_pointer_button(void *data, struct wl_pointer *wl_pointer, uint32_t serial,
+		uint32_t time, uint32_t button, uint32_t state)
+{
+	struct seat *seat = data;
+	trace_instant(TRACE_REMOTE_POINTER_BUTTON, button);
+	input_record_button(seat->server, time, button, state);
+	seat_pointer_button(seat, time, button, state);
+}
+
 static void
 handle_wl_pointer_axis(void *data, struct wl_pointer *wl_pointer, uint32_t time,
 		uint32_t axis, wl_fixed_t value)
@@ -130,9 +160,9 @@ static void
 handle_wl_pointer_frame(void *data, struct wl_pointer *wl_pointer)
 {
 	struct seat *seat = data;
-	wl_signal_emit_mutable(&seat->wlr_pointer.events.frame, &seat->wlr_pointer);
-	struct frontend *frontend = seat->server->frontend;
-	wl_signal_emit_mutable(&frontend->cursor->events.frame, &frontend->cursor);
+	trace_instant(TRACE_REMOTE_POINTER_FRAME, 0);
+	input_record_frame(seat->server);
+	seat_pointer_frame(seat);
 }
 
 static void
@@ -179,6 +209,7 @@ init_seat_pointer(struct seat *seat, struct wl_pointer *wl_pointer)
 	snprintf(name, sizeof(name), "wayland-pointer-%s", seat->name ? : "");
 	wlr_pointer_init(&seat->wlr_pointer, &wl_pointer_impl, name);
 	wl_pointer_add_listener(wl_pointer, &pointer_listener, seat);
+	seat->has_pointer = true;
 }
 
 static void
@@ -218,6 +249,22 @@ seat_init(struct server *server, struct wl_seat *wl_seat)
 	wl_seat_add_listener(wl_seat, &seat_listener, seat);
 }
 
+static void
+presentation_handle_clock_id(void *data, struct wp_presentation *presentation,
+		uint32_t clock_id)
+{
+	struct backend *backend = data;
+	backend->presentation_clock = clock_id;
+	if (clock_id != CLOCK_MONOTONIC) {
+		fprintf(stderr, "info: remote presentation clock is %u, converting "
+			"timestamps to CLOCK_MONOTONIC\n", clock_id);
+	}
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+	.clock_id = presentation_handle_clock_id,
+};
+
 static void
 handle_global(void *data, struct wl_registry *registry, uint32_t name,
 		const char *interface, uint32_t version)
@@ -231,11 +278,26 @@ handle_global(void *data, struct wl_registry *registry, uint32_t name,
 		server->backend->subcompositor = wl_registry_bind(registry, name,
 			&wl_subcompositor_interface, 1);
 	} else if (!strcmp(interface, zwlr_layer_shell_v1_interface.name)) {
-		layer_shell = wl_registry_bind(registry, name,
+		server->backend->layer_shell = wl_registry_bind(registry, name,
 			&zwlr_layer_shell_v1_interface, 4);
 	} else if (!strcmp(interface, wl_output_interface.name)) {
-		wl_output = wl_registry_bind(registry, name,
+		struct wl_output *wl_output = wl_registry_bind(registry, name,
 			&wl_output_interface, 4);
+		panel_add(server, name, wl_output);
+	} else if (!strcmp(interface, wp_presentation_interface.name)) {
+		server->backend->presentation = wl_registry_bind(registry, name,
+			&wp_presentation_interface, 1);
+		wp_presentation_add_listener(server->backend->presentation,
+			&presentation_listener, server->backend);
+	} else if (!strcmp(interface, wp_viewporter_interface.name)) {
+		server->backend->viewporter = wl_registry_bind(registry, name,
+			&wp_viewporter_interface, 1);
+	} else if (!strcmp(interface, wp_single_pixel_buffer_manager_v1_interface.name)) {
+		server->backend->single_pixel_buffer_manager = wl_registry_bind(registry,
+			name, &wp_single_pixel_buffer_manager_v1_interface, 1);
+	} else if (!strcmp(interface, wp_fractional_scale_manager_v1_interface.name)) {
+		server->backend->fractional_scale_manager = wl_registry_bind(registry,
+			name, &wp_fractional_scale_manager_v1_interface, 1);
 	} else if (!strcmp(interface, wl_shm_interface.name)) {
 		server->backend->shm = wl_registry_bind(registry, name,
 			&wl_shm_interface, 1);
@@ -250,7 +312,9 @@ handle_global(void *data, struct wl_registry *registry, uint32_t name,
 static void
 handle_global_remove(void *data, struct wl_registry *registry, uint32_t name)
 {
-	/* No-op */
+	struct server *server = data;
+	/* Only outputs are expected to come and go */
+	panel_remove(server, name);
 }
 
 static const struct wl_registry_listener registry_listener = {
@@ -336,11 +400,28 @@ error:
 	exit(EXIT_FAILURE);
 }
 
+static void
+globals_handle_done(void *data, struct wl_callback *callback, uint32_t serial)
+{
+	struct backend *backend = data;
+	wl_callback_destroy(callback);
+	backend->globals_callback = NULL;
+}
+
+static const struct wl_callback_listener globals_listener = {
+	.done = globals_handle_done,
+};
+
+/*
+ * Only asks for the globals; they are waited for in backend_wait_globals(), so
+ * the local display and plugins can be started in the meantime.
+ */
 void
 backend_init(struct server *server, struct backend *backend)
 {
 	server->backend = backend;
 	backend->server = server;
+	backend->presentation_clock = -1;
 
 	/*
 	 * Register global bindings against the backend/remote wayland
@@ -348,13 +429,40 @@ backend_init(struct server *server, struct backend *backend)
 	 *
 	 * https://wayland-book.com/registry/binding.html
 	 */
+	wl_list_init(&server->panels);
 	backend->remote_display = wl_display_connect(NULL);
+	if (!backend->remote_display) {
+		fprintf(stderr, "fatal: cannot connect to remote compositor\n");
+		exit(EXIT_FAILURE);
+	}
 	struct wl_registry *registry = wl_display_get_registry(backend->remote_display);
 	wl_registry_add_listener(registry, &registry_listener, server);
-	wl_display_roundtrip(backend->remote_display);
+	/* All globals have been announced once this is done */
+	backend->globals_callback = wl_display_sync(backend->remote_display);
+	wl_callback_add_listener(backend->globals_callback, &globals_listener, backend);
+	wl_display_flush(backend->remote_display);
+
+	/* EGL is slow to start and not needed for a plain background */
+	if (server->egl_background) {
+		init_egl(backend);
+	}
+}
 
+/*
+ * Anything dispatching the remote display in the meantime, such as the
+ * roundtrips in wlr_wl_backend_create(), may already have delivered the
+ * globals, in which case this does not block.
+ */
+void
+backend_wait_globals(struct backend *backend)
+{
+	while (backend->globals_callback) {
+		if (wl_display_dispatch(backend->remote_display) < 0) {
+			fprintf(stderr, "fatal: lost connection to remote compositor\n");
+			exit(EXIT_FAILURE);
+		}
+	}
 	init_cursor(backend);
-	init_egl(backend);
 }
 
 void
@@ -0,0 +1,363 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "panel.h"
+
+/*
+ * The panel listens on $XDG_RUNTIME_DIR/carthusian-$WAYLAND_DISPLAY.sock for
+ * one command per line. Each answer ends with a line of "ok" or "error: ...":
+ *
+ *     echo stats | socat - UNIX-CONNECT:$XDG_RUNTIME_DIR/carthusian-wayland-1.sock
+ *
+ * Changes are applied to the running panel; plugins which are already
+ * connected stay connected and keep their state.
+ */
+
+#define CONTROL_LINE_MAX (1024)
+/* A client which does not read its answers is not waited for longer */
+#define CONTROL_SEND_TIMEOUT_MS (100)
+
+struct control_client {
+	struct server *server;
+	int fd;
+	struct wl_event_source *source;
+	char buf[CONTROL_LINE_MAX];
+	size_t len;
+	struct wl_list link; /* control.clients */
+};
+
+/* The toplevel at @index in layout order */
+static struct toplevel *
+toplevel_at_index(struct server *server, const char *arg, FILE *out)
+{
+	int index;
+	struct toplevel **toplevels = server->toplevel_index.data;
+	size_t count = server->toplevel_index.size / sizeof(*toplevels);
+	if (!parse_int(arg, &index) || (size_t)index >= count) {
+		fprintf(out, "error: no plugin at index '%s'\n", arg);
+		return NULL;
+	}
+	return toplevels[index];
+}
+
+static bool
+command_stats(struct server *server, char *args, FILE *out)
+{
+	stats_dump(server, out);
+	return true;
+}
+
+static bool
+command_plugins(struct server *server, char *args, FILE *out)
+{
+	int i = 0;
+	struct toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->toplevels, link) {
+		fprintf(out, "%d %s pid=%d width=%d%s\n", i, toplevel_app_id(toplevel),
+			(int)toplevel->rate.pid, toplevel->geometry.width,
+			toplevel->ghost ? " ghost" : "");
+		i++;
+	}
+	return true;
+}
+
+static bool
+command_height(struct server *server, char *args, FILE *out)
+{
+	int height;
+	if (!parse_int(args, &height) || height <= 2 * MARGIN_HORIZONTAL) {
+		fprintf(out, "error: invalid height '%s'\n", args);
+		return false;
+	}
+	panel_set_height(server, height);
+	return true;
+}
+
+static bool
+command_background(struct server *server, char *args, FILE *out)
+{
+	uint32_t rgba;
+	if (!parse_color(args, &rgba)) {
+		fprintf(out, "error: invalid color '%s'\n", args);
+		return false;
+	}
+	render_set_background(server, rgba);
+	return true;
+}
+
+static bool
+command_move(struct server *server, char *args, FILE *out)
+{
+	char *saveptr;
+	char *from = strtok_r(args, " \t", &saveptr);
+	char *to = strtok_r(NULL, " \t", &saveptr);
+	int index;
+	if (!from || !to || !parse_int(to, &index)) {
+		fprintf(out, "error: usage: move <from> <to>\n");
+		return false;
+	}
+	struct toplevel *toplevel = toplevel_at_index(server, from, out);
+	if (!toplevel) {
+		return false;
+	}
+	layout_move(toplevel, index);
+	return true;
+}
+
+static bool
+command_add(struct server *server, char *args, FILE *out)
+{
+	if (!*args) {
+		fprintf(out, "error: usage: add <command>\n");
+		return false;
+	}
+	if (!supervisor_launch(server, args)) {
+		fprintf(out, "error: cannot start plugin '%s'\n", args);
+		return false;
+	}
+	return true;
+}
+
+static bool
+command_remove(struct server *server, char *args, FILE *out)
+{
+	struct toplevel *toplevel = toplevel_at_index(server, args, out);
+	if (!toplevel) {
+		return false;
+	}
+	if (toplevel->ghost) {
+		ghost_release(toplevel);
+		return true;
+	}
+	toplevel->removed = true;
+	if (toplevel->native) {
+		native_plugin_unload(toplevel);
+	} else if (!supervisor_remove(server, toplevel->rate.pid)) {
+		/* Not started by the panel, so only its connection is closed */
+		wl_client_destroy(wl_resource_get_client(toplevel->xdg_toplevel->resource));
+	}
+	return true;
+}
+
+static bool command_help(struct server *server, char *args, FILE *out);
+
+static const struct {
+	const char *name;
+	const char *help;
+	bool (*handler)(struct server *server, char *args, FILE *out);
+} commands[] = {
+	{ "stats", "Dump frame, plugin and memory statistics", command_stats },
+	{ "plugins", "List plugins in layout order", command_plugins },
+	{ "height <px>", "Set the panel height", command_height },
+	{ "background <color>", "Set the background color", command_background },
+	{ "move <from> <to>", "Move a plugin to another place", command_move },
+	{ "add <command>", "Start and supervise a plugin", command_add },
+	{ "remove <index>", "Stop a plugin and close its connection", command_remove },
+	{ "help", "Show this list", command_help },
+};
+
+static bool
+command_help(struct server *server, char *args, FILE *out)
+{
+	for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+		fprintf(out, "%-20s %s\n", commands[i].name, commands[i].help);
+	}
+	return true;
+}
+
+static void
+control_client_destroy(struct control_client *client)
+{
+	wl_event_source_remove(client->source);
+	close(client->fd);
+	wl_list_remove(&client->link);
+	free(client);
+}
+
+static void
+control_client_send(struct control_client *client, const char *data, size_t len)
+{
+	while (len) {
+		ssize_t n = write(client->fd, data, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			fprintf(stderr, "warn: control client not reading, answer dropped\n");
+			return;
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+static void
+control_client_run(struct control_client *client, char *line)
+{
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *out = open_memstream(&buf, &size);
+	if (!out) {
+		return;
+	}
+
+	char *args = line + strcspn(line, " \t");
+	size_t name_len = args - line;
+	args += strspn(args, " \t");
+
+	bool found = false;
+	for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+		const char *name = commands[i].name;
+		if (strcspn(name, " ") == name_len && !strncmp(name, line, name_len)) {
+			found = true;
+			if (commands[i].handler(client->server, args, out)) {
+				fprintf(out, "ok\n");
+			}
+			break;
+		}
+	}
+	if (!found) {
+		fprintf(out, "error: unknown command '%.*s', try help\n", (int)name_len, line);
+	}
+	fclose(out);
+	control_client_send(client, buf, size);
+	free(buf);
+}
+
+static int
+handle_client_readable(int fd, uint32_t mask, void *data)
+{
+	struct control_client *client = data;
+	if (mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR)) {
+		control_client_destroy(client);
+		return 0;
+	}
+	ssize_t n = read(fd, client->buf + client->len, sizeof(client->buf) - client->len);
+	if (n < 0 && errno == EINTR) {
+		return 0;
+	}
+	if (n <= 0) {
+		control_client_destroy(client);
+		return 0;
+	}
+	client->len += n;
+
+	char *start = client->buf;
+	char *newline;
+	while ((newline = memchr(start, '\n', client->buf + client->len - start))) {
+		*newline = '\0';
+		if (newline > start && newline[-1] == '\r') {
+			newline[-1] = '\0';
+		}
+		if (*start) {
+			control_client_run(client, start);
+		}
+		start = newline + 1;
+	}
+	client->len -= start - client->buf;
+	memmove(client->buf, start, client->len);
+	if (client->len == sizeof(client->buf)) {
+		fprintf(stderr, "warn: control command too long, disconnecting\n");
+		control_client_destroy(client);
+	}
+	return 0;
+}
+
+static int
+handle_connection(int fd, uint32_t mask, void *data)
+{
+	struct server *server = data;
+	int client_fd = accept(fd, NULL, NULL);
+	if (client_fd < 0) {
+		fprintf(stderr, "warn: cannot accept control connection: %s\n",
+			strerror(errno));
+		return 0;
+	}
+	fcntl(client_fd, F_SETFD, FD_CLOEXEC);
+	/* Answers are written in one go, but a stuck client must not stall us */
+	struct timeval timeout = { .tv_usec = CONTROL_SEND_TIMEOUT_MS * 1000 };
+	setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	struct control_client *client = calloc(1, sizeof(*client));
+	if (!client) {
+		close(client_fd);
+		return 0;
+	}
+	client->server = server;
+	client->fd = client_fd;
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(server->frontend->local_display);
+	client->source = wl_event_loop_add_fd(loop, client_fd, WL_EVENT_READABLE,
+		handle_client_readable, client);
+	if (!client->source) {
+		close(client_fd);
+		free(client);
+		return 0;
+	}
+	wl_list_insert(&server->control.clients, &client->link);
+	return 0;
+}
+
+void
+control_init(struct server *server, struct wl_event_loop *event_loop)
+{
+	struct control *control = &server->control;
+	wl_list_init(&control->clients);
+	control->fd = -1;
+
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	const char *display = getenv("WAYLAND_DISPLAY");
+	if (!runtime_dir || !display) {
+		fprintf(stderr, "warn: XDG_RUNTIME_DIR not set, no control socket\n");
+		return;
+	}
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int len = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/carthusian-%s.sock",
+		runtime_dir, display);
+	if (len < 0 || (size_t)len >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "warn: control socket path too long\n");
+		return;
+	}
+
+	control->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (control->fd < 0) {
+		fprintf(stderr, "warn: cannot create control socket: %s\n", strerror(errno));
+		return;
+	}
+	/* The name follows WAYLAND_DISPLAY, whose lock we hold, so it is stale */
+	unlink(addr.sun_path);
+	if (bind(control->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+			|| listen(control->fd, 4) < 0) {
+		fprintf(stderr, "warn: cannot listen on '%s': %s\n", addr.sun_path,
+			strerror(errno));
+		close(control->fd);
+		control->fd = -1;
+		return;
+	}
+	control->path = strdup(addr.sun_path);
+	control->source = wl_event_loop_add_fd(event_loop, control->fd, WL_EVENT_READABLE,
+		handle_connection, server);
+	fprintf(stderr, "info: control socket at '%s'\n", addr.sun_path);
+}
+
+void
+control_finish(struct server *server)
+{
+	struct control *control = &server->control;
+	struct control_client *client, *tmp;
+	wl_list_for_each_safe(client, tmp, &control->clients, link) {
+		control_client_destroy(client);
+	}
+	if (control->source) {
+		wl_event_source_remove(control->source);
+	}
+	if (control->fd >= 0) {
+		close(control->fd);
+	}
+	if (control->path) {
+		unlink(control->path);
+		free(control->path);
+	}
+}
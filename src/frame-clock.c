@@ -0,0 +1,215 @@
+#include "panel.h"
+
+/*
+ * Plugins are paced by the remote compositor's frame clock rather than by
+ * the nested output, so that they only render when the remote compositor is
+ * actually going to show something.
+ *
+ * After a commit the wayland backend requests a frame callback on
+ * child_surface and the next frame event of the nested output comes from that
+ * callback, so frame_done is sent then. When there was nothing to commit, a
+ * frame callback is requested on main_surface instead.
+ *
+ * child_surface is a synchronized subsurface, so the nested output's commit
+ * only takes effect with the main_surface commit which follows it in the same
+ * frame. The background and plugins are therefore always presented together,
+ * and main_surface is committed at most once per frame.
+ */
+
+/*
+ * Remote compositors stop sending frame callbacks to surfaces which are not
+ * visible, for example under a fullscreen window. When a frame callback has
+ * been outstanding for this long the panel is considered occluded; the
+ * nested output and plugins are then already idle, as they wait for that
+ * callback, and plugins are also told they are suspended, see panel.c.
+ */
+#define OCCLUSION_TIMEOUT_MS (500)
+
+static int
+handle_occlusion_timeout(void *data)
+{
+	struct panel *panel = data;
+	panel_set_occluded(panel, true);
+	return 0;
+}
+
+static void
+watch_remote_frame(struct panel *panel)
+{
+	wl_event_source_timer_update(panel->frame_clock.occlusion_timer,
+		OCCLUSION_TIMEOUT_MS);
+}
+
+static void
+remote_frame_arrived(struct panel *panel)
+{
+	wl_event_source_timer_update(panel->frame_clock.occlusion_timer, 0);
+	panel_set_occluded(panel, false);
+}
+
+/*
+ * Each panel has its own frame clock. Like wlr_scene_output_send_frame_done(),
+ * frame_done only goes to surfaces whose primary output is the one given, so
+ * a plugin shown on several panels is paced by one of them. Plugins over
+ * --max-commit-rate get theirs later, see xdg-shell.c.
+ */
+struct frame_done {
+	struct panel *panel;
+	struct timespec now;
+};
+
+static void
+send_buffer_frame_done(struct wlr_scene_buffer *buffer, int sx, int sy, void *data)
+{
+	struct frame_done *frame_done = data;
+	struct panel *panel = frame_done->panel;
+	if (buffer->primary_output != panel->scene_output) {
+		return;
+	}
+	struct toplevel *toplevel = toplevel_from_node(panel->server, &buffer->node);
+	if (toplevel && !toplevel_frame_done_allowed(toplevel, &frame_done->now)) {
+		return;
+	}
+	wlr_scene_buffer_send_frame_done(buffer, &frame_done->now);
+}
+
+static void
+send_frame_done(struct panel *panel)
+{
+	struct frame_done frame_done = { .panel = panel };
+	trace_begin(TRACE_FRAME_DONE, panel->global_name);
+	clock_gettime(CLOCK_MONOTONIC, &frame_done.now);
+	wlr_scene_output_for_each_buffer(panel->scene_output, send_buffer_frame_done,
+		&frame_done);
+	trace_end(TRACE_FRAME_DONE);
+}
+
+static void
+remote_frame_handle_done(void *data, struct wl_callback *callback, uint32_t t)
+{
+	struct panel *panel = data;
+	wl_callback_destroy(callback);
+	panel->frame_clock.callback = NULL;
+	trace_instant(TRACE_REMOTE_FRAME_DONE, panel->global_name);
+	remote_frame_arrived(panel);
+	send_frame_done(panel);
+	if (panel->background.needs_redraw || panel->needs_commit) {
+		wlr_output_schedule_frame(panel->wlr_output);
+	}
+}
+
+static const struct wl_callback_listener remote_frame_listener = {
+	.done = remote_frame_handle_done,
+};
+
+static void
+request_remote_frame(struct panel *panel)
+{
+	if (panel->frame_clock.callback) {
+		return;
+	}
+	panel->frame_clock.callback = wl_surface_frame(panel->main_surface);
+	wl_callback_add_listener(panel->frame_clock.callback,
+		&remote_frame_listener, panel);
+	render_panel_commit(panel);
+	watch_remote_frame(panel);
+}
+
+static void
+output_handle_frame(struct wl_listener *listener, void *data)
+{
+	struct panel *panel = wl_container_of(listener, panel, output_frame);
+	struct server *server = panel->server;
+	struct stats *stats = &server->stats;
+
+	trace_begin(TRACE_OUTPUT_FRAME, panel->global_name);
+	bool remote_paced = panel->frame_clock.remote_paced;
+	panel->frame_clock.remote_paced = false;
+	if (remote_paced) {
+		/* This frame event came from the remote frame callback */
+		remote_frame_arrived(panel);
+		send_frame_done(panel);
+	}
+
+	/*
+	 * Only commit when the scene has pending damage. Without a commit the
+	 * nested output does not get a new frame event, so an idle panel stops
+	 * scheduling frames until the scene is damaged again.
+	 */
+	bool committed = false;
+	if (!server->supervisor.startup_complete || !panel->width
+			|| server->transaction.pending) {
+		/*
+		 * Avoid presenting a half laid out panel during startup or a
+		 * resize, or before the remote compositor has told us the
+		 * panel size
+		 */
+		stats->output_commits_skipped++;
+	} else if (wlr_scene_output_needs_frame(panel->scene_output)) {
+		trace_begin(TRACE_SCENE_COMMIT, panel->global_name);
+		committed = wlr_scene_output_commit(panel->scene_output, NULL);
+		trace_end(TRACE_SCENE_COMMIT);
+		if (committed) {
+			stats_scene_commit(panel);
+		}
+		stats->output_commits++;
+	} else {
+		stats->output_commits_skipped++;
+	}
+
+	if (committed) {
+		render_panel_commit(panel);
+		panel->frame_clock.remote_paced = true;
+		watch_remote_frame(panel);
+	} else if (remote_paced && (panel->background.needs_redraw
+			|| panel->needs_commit)) {
+		/* Already paced by the remote compositor this frame */
+		render_panel_commit(panel);
+	} else if (!remote_paced) {
+		/*
+		 * Plugins which committed without damage, for example only to
+		 * ask for a frame callback, still need frame_done.
+		 */
+		request_remote_frame(panel);
+	}
+	trace_end(TRACE_OUTPUT_FRAME);
+}
+
+static void
+output_handle_present(struct wl_listener *listener, void *data)
+{
+	struct panel *panel = wl_container_of(listener, panel, output_present);
+	struct wlr_output_event_present *event = data;
+
+	/* The wayland backend forwards the remote wp_presentation feedback */
+	if (!event->presented || !event->when) {
+		return;
+	}
+	trace_instant(TRACE_REMOTE_PRESENTED, event->commit_seq);
+	stats_scene_present(panel, event->commit_seq, event->when);
+}
+
+void
+frame_clock_init(struct panel *panel)
+{
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(panel->server->frontend->local_display);
+	panel->frame_clock.occlusion_timer =
+		wl_event_loop_add_timer(loop, handle_occlusion_timeout, panel);
+	panel->output_frame.notify = output_handle_frame;
+	wl_signal_add(&panel->wlr_output->events.frame, &panel->output_frame);
+	panel->output_present.notify = output_handle_present;
+	wl_signal_add(&panel->wlr_output->events.present, &panel->output_present);
+}
+
+void
+frame_clock_finish(struct panel *panel)
+{
+	wl_list_remove(&panel->output_frame.link);
+	wl_list_remove(&panel->output_present.link);
+	wl_event_source_remove(panel->frame_clock.occlusion_timer);
+	if (panel->frame_clock.callback) {
+		wl_callback_destroy(panel->frame_clock.callback);
+		panel->frame_clock.callback = NULL;
+	}
+}
@@ -0,0 +1,134 @@
+#include <wlr/types/wlr_buffer.h>
+#include "panel.h"
+
+/*
+ * When a plugin toplevel unmaps, because the plugin crashed, is being
+ * restarted or just hid its window, its slot in the layout is kept by a ghost
+ * showing the last buffer the plugin committed. Nothing to its right moves.
+ * A toplevel with the same app_id mapping within GHOST_GRACE_MS takes the
+ * slot over, otherwise the ghost goes away and the layout closes the gap.
+ */
+
+#define GHOST_GRACE_MS (5000)
+
+struct ghost {
+	struct toplevel toplevel;
+	char *app_id;
+	/* The plugin's last wlr_client_buffer, which holds on to its texture */
+	struct wlr_buffer *buffer;
+	struct wl_event_source *grace_timer;
+};
+
+static void
+ghost_destroy(struct ghost *ghost)
+{
+	if (ghost->grace_timer) {
+		wl_event_source_remove(ghost->grace_timer);
+	}
+	if (ghost->toplevel.scene_tree) {
+		wlr_scene_node_destroy(&ghost->toplevel.scene_tree->node);
+	}
+	if (ghost->buffer) {
+		wlr_buffer_unlock(ghost->buffer);
+	}
+	free(ghost->app_id);
+	free(ghost);
+}
+
+/* The slot is not kept any longer, for example on request */
+void
+ghost_release(struct toplevel *toplevel)
+{
+	layout_remove(toplevel);
+	ghost_destroy(toplevel->ghost);
+}
+
+static int
+handle_grace_timeout(void *data)
+{
+	struct ghost *ghost = data;
+	fprintf(stderr, "info: plugin '%s' did not come back, releasing its slot\n",
+		ghost->app_id);
+	ghost_release(&ghost->toplevel);
+	return 0;
+}
+
+const char *
+ghost_app_id(struct toplevel *toplevel)
+{
+	return toplevel->ghost->app_id;
+}
+
+/*
+ * Called when @toplevel unmaps, before its surface state is dropped. Returns
+ * false if there is nothing to keep, in which case the caller removes it from
+ * the layout.
+ */
+bool
+ghost_create(struct toplevel *toplevel)
+{
+	struct server *server = toplevel->server;
+	struct wlr_surface *surface = toplevel->xdg_toplevel->base->surface;
+	const char *app_id = toplevel->xdg_toplevel->app_id;
+	if (!app_id || !surface->buffer || toplevel->removed || toplevel->rejected
+			|| wl_list_empty(&toplevel->link)) {
+		return false;
+	}
+
+	struct ghost *ghost = calloc(1, sizeof(*ghost));
+	if (!ghost) {
+		return false;
+	}
+	struct toplevel *slot = &ghost->toplevel;
+	slot->server = server;
+	slot->ghost = ghost;
+	slot->geometry = toplevel->geometry;
+	ghost->app_id = strdup(app_id);
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(server->frontend->local_display);
+	ghost->grace_timer = wl_event_loop_add_timer(loop, handle_grace_timeout, ghost);
+	slot->scene_tree = wlr_scene_tree_create(&server->scene->tree);
+	if (!ghost->app_id || !ghost->grace_timer || !slot->scene_tree) {
+		ghost_destroy(ghost);
+		return false;
+	}
+	slot->scene_tree->node.data = slot;
+
+	ghost->buffer = wlr_buffer_lock(&surface->buffer->base);
+	struct wlr_scene_buffer *scene_buffer =
+		wlr_scene_buffer_create(slot->scene_tree, ghost->buffer);
+	if (scene_buffer) {
+		/* Placed like wlr_scene_xdg_surface_create() places the surface */
+		wlr_scene_node_set_position(&scene_buffer->node,
+			-toplevel->geometry.x, -toplevel->geometry.y);
+		wlr_scene_buffer_set_dest_size(scene_buffer, surface->current.width,
+			surface->current.height);
+	}
+
+	/* Same width, so the layout stops right after the ghost */
+	layout_replace(toplevel, slot);
+	wl_event_source_timer_update(ghost->grace_timer, GHOST_GRACE_MS);
+	return true;
+}
+
+/*
+ * Called when @toplevel maps. Returns true if it took over the slot of a
+ * ghost with the same app_id, and false if it still needs a place.
+ */
+bool
+ghost_claim(struct toplevel *toplevel)
+{
+	const char *app_id = toplevel->xdg_toplevel->app_id;
+	if (!app_id) {
+		return false;
+	}
+	struct toplevel *slot;
+	wl_list_for_each(slot, &toplevel->server->toplevels, link) {
+		if (slot->ghost && !strcmp(slot->ghost->app_id, app_id)) {
+			layout_replace(slot, toplevel);
+			ghost_destroy(slot->ghost);
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,238 @@
+#include <errno.h>
+#include <inttypes.h>
+#include "panel.h"
+
+/*
+ * Remote pointer events can be recorded to a file and replayed later through
+ * the same path the remote events take, at the original speed or faster. The
+ * time from each event reaching the panel to it being handed to wlr_seat is
+ * kept in the input.event_to_seat histogram, so replaying a recording is a
+ * repeatable way to measure the input path.
+ *
+ * The file is an 8 byte magic followed by fixed size records in host byte
+ * order; it is not meant to be moved between machines.
+ */
+
+#define INPUT_RECORD_MAGIC "CARTINP1"
+
+enum input_event_type {
+	INPUT_EVENT_MOTION = 1,
+	INPUT_EVENT_BUTTON,
+	INPUT_EVENT_FRAME,
+};
+
+struct input_event {
+	/* Since the recording started */
+	uint64_t time_nsec;
+	uint32_t type;
+	/* Timestamp given by the remote compositor */
+	uint32_t time_msec;
+	/* surface_x and surface_y for motion, button and state for buttons */
+	int32_t a, b;
+};
+
+static uint64_t
+nsec_since(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000
+		+ now.tv_nsec - start->tv_nsec;
+}
+
+bool
+input_record_open(struct server *server, const char *path)
+{
+	struct input *input = &server->input;
+	input->record = fopen(path, "wb");
+	if (!input->record) {
+		fprintf(stderr, "fatal: cannot open '%s': %s\n", path, strerror(errno));
+		return false;
+	}
+	fwrite(INPUT_RECORD_MAGIC, 1, strlen(INPUT_RECORD_MAGIC), input->record);
+	clock_gettime(CLOCK_MONOTONIC, &input->record_start);
+	return true;
+}
+
+static void
+record_event(struct server *server, uint32_t type, uint32_t time_msec, int32_t a,
+		int32_t b)
+{
+	struct input *input = &server->input;
+	if (!input->record) {
+		return;
+	}
+	struct input_event event = {
+		.time_nsec = nsec_since(&input->record_start),
+		.type = type,
+		.time_msec = time_msec,
+		.a = a,
+		.b = b,
+	};
+	/* stdio buffers this, the file is flushed on exit */
+	fwrite(&event, sizeof(event), 1, input->record);
+}
+
+void
+input_record_motion(struct server *server, uint32_t time, wl_fixed_t x, wl_fixed_t y)
+{
+	record_event(server, INPUT_EVENT_MOTION, time, x, y);
+}
+
+void
+input_record_button(struct server *server, uint32_t time, uint32_t button,
+		uint32_t state)
+{
+	record_event(server, INPUT_EVENT_BUTTON, time, button, state);
+}
+
+void
+input_record_frame(struct server *server)
+{
+	record_event(server, INPUT_EVENT_FRAME, 0, 0, 0);
+}
+
+/* @arg is the path optionally followed by ":speed", for example "in.rec:4" */
+bool
+input_replay_open(struct server *server, const char *arg)
+{
+	struct input *input = &server->input;
+	char *path = strdup(arg);
+	if (!path) {
+		return false;
+	}
+	input->replay_speed = 1.0;
+	char *colon = strrchr(path, ':');
+	if (colon) {
+		char *end;
+		double speed = strtod(colon + 1, &end);
+		if (!*end && speed > 0) {
+			*colon = '\0';
+			input->replay_speed = speed;
+		}
+	}
+
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		fprintf(stderr, "fatal: cannot open '%s': %s\n", path, strerror(errno));
+		free(path);
+		return false;
+	}
+	char magic[sizeof(INPUT_RECORD_MAGIC)] = {0};
+	if (fread(magic, 1, strlen(INPUT_RECORD_MAGIC), f) != strlen(INPUT_RECORD_MAGIC)
+			|| strcmp(magic, INPUT_RECORD_MAGIC)) {
+		fprintf(stderr, "fatal: '%s' is not an input recording\n", path);
+		fclose(f);
+		free(path);
+		return false;
+	}
+
+	struct wl_array events;
+	wl_array_init(&events);
+	struct input_event event;
+	while (fread(&event, sizeof(event), 1, f) == 1) {
+		struct input_event *slot = wl_array_add(&events, sizeof(*slot));
+		if (!slot) {
+			break;
+		}
+		*slot = event;
+	}
+	fclose(f);
+
+	input->replay_events = events;
+	input->replay_next = 0;
+	fprintf(stderr, "info: replaying %zu input events from '%s' at %.2fx\n",
+		events.size / sizeof(event), path, input->replay_speed);
+	free(path);
+	return true;
+}
+
+static uint64_t
+replay_event_due_nsec(struct input *input, const struct input_event *event)
+{
+	return event->time_nsec / input->replay_speed;
+}
+
+static void
+replay_arm_timer(struct input *input, const struct input_event *event)
+{
+	uint64_t now = nsec_since(&input->replay_start);
+	uint64_t due = replay_event_due_nsec(input, event);
+	/* Timers only have millisecond resolution; 0 would disarm it */
+	int delay_ms = due > now ? (due - now + 999999) / 1000000 : 1;
+	wl_event_source_timer_update(input->replay_timer, delay_ms);
+}
+
+static int
+handle_replay_timer(void *data)
+{
+	struct server *server = data;
+	struct input *input = &server->input;
+	struct seat *seat = server->backend->seat;
+
+	struct input_event *events = input->replay_events.data;
+	size_t count = input->replay_events.size / sizeof(*events);
+	uint64_t now = nsec_since(&input->replay_start);
+
+	while (input->replay_next < count) {
+		struct input_event *event = &events[input->replay_next];
+		if (replay_event_due_nsec(input, event) > now) {
+			replay_arm_timer(input, event);
+			return 0;
+		}
+		input->replay_next++;
+		switch (event->type) {
+		case INPUT_EVENT_MOTION:
+			seat_pointer_motion(seat, event->time_msec, event->a, event->b);
+			break;
+		case INPUT_EVENT_BUTTON:
+			seat_pointer_button(seat, event->time_msec, event->a, event->b);
+			break;
+		case INPUT_EVENT_FRAME:
+			seat_pointer_frame(seat);
+			break;
+		}
+	}
+
+	fprintf(stderr, "info: input replay finished after %" PRIu64 "ms\n",
+		now / 1000000);
+	stats_dump(server, stderr);
+	return 0;
+}
+
+/* Called once the panel is first shown, so plugins are in place */
+void
+input_replay_start(struct server *server)
+{
+	struct input *input = &server->input;
+	if (!input->replay_events.size || input->replay_timer) {
+		return;
+	}
+	if (!server->backend->seat || !server->backend->seat->has_pointer) {
+		fprintf(stderr, "warn: no remote pointer, not replaying input\n");
+		return;
+	}
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(server->frontend->local_display);
+	input->replay_timer = wl_event_loop_add_timer(loop, handle_replay_timer, server);
+	if (!input->replay_timer) {
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &input->replay_start);
+	replay_arm_timer(input, input->replay_events.data);
+}
+
+void
+input_finish(struct server *server)
+{
+	struct input *input = &server->input;
+	if (input->record) {
+		fclose(input->record);
+		input->record = NULL;
+	}
+	if (input->replay_timer) {
+		wl_event_source_remove(input->replay_timer);
+		input->replay_timer = NULL;
+	}
+	wl_array_release(&input->replay_events);
+}
@@ -0,0 +1,179 @@
+#include "panel.h"
+
+/*
+ * Position @start and the toplevels to its right. Toplevels to the left of
+ * @start are not affected by a change to its width, and neither is anything
+ * after the first toplevel which ends up where it already was, so the
+ * scene-nodes of those are left untouched.
+ */
+static void
+arrange_toplevels(struct server *server, struct toplevel *start)
+{
+	trace_begin(TRACE_LAYOUT, 0);
+	int y = MARGIN_HORIZONTAL;
+	int x = MARGIN_VERTICAL;
+	if (start->link.prev != &server->toplevels) {
+		struct toplevel *prev = wl_container_of(start->link.prev, prev, link);
+		x = prev->x + prev->geometry.width + PADDING;
+	}
+
+	for (struct wl_list *link = &start->link; link != &server->toplevels;
+			link = link->next) {
+		struct toplevel *toplevel = wl_container_of(link, toplevel, link);
+		if (toplevel != start && toplevel->x == x) {
+			break;
+		}
+		toplevel->x = x;
+		wlr_scene_node_set_position(&toplevel->scene_tree->node, x, y);
+		passthrough_move(toplevel);
+		x += toplevel->geometry.width + PADDING;
+	}
+	trace_end(TRACE_LAYOUT);
+}
+
+/*
+ * The panel is a one-dimensional strip, so the toplevels in layout order are
+ * also sorted by x. This only needs rebuilding when a toplevel is mapped,
+ * unmapped, replaced or moved because arrange_toplevels() keeps the
+ * positions up-to-date.
+ */
+static void
+update_toplevel_index(struct server *server)
+{
+	server->toplevel_index.size = 0;
+	struct toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->toplevels, link) {
+		struct toplevel **entry = wl_array_add(&server->toplevel_index,
+			sizeof(*entry));
+		if (!entry) {
+			fprintf(stderr, "fatal: unable to grow toplevel index\n");
+			exit(EXIT_FAILURE);
+		}
+		*entry = toplevel;
+	}
+}
+
+struct toplevel *
+toplevel_index_lookup(struct server *server, double lx)
+{
+	struct toplevel **toplevels = server->toplevel_index.data;
+	size_t lo = 0;
+	size_t hi = server->toplevel_index.size / sizeof(*toplevels);
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		struct toplevel *toplevel = toplevels[mid];
+		if (lx < toplevel->x) {
+			hi = mid;
+		} else if (lx >= toplevel->x + toplevel->geometry.width) {
+			lo = mid + 1;
+		} else {
+			return toplevel;
+		}
+	}
+	return NULL;
+}
+
+void
+layout_add(struct toplevel *toplevel)
+{
+	wl_list_insert(toplevel->server->toplevels.prev, &toplevel->link);
+	arrange_toplevels(toplevel->server, toplevel);
+	update_toplevel_index(toplevel->server);
+}
+
+void
+layout_remove(struct toplevel *toplevel)
+{
+	struct server *server = toplevel->server;
+	struct wl_list *next = toplevel->link.next;
+	wl_list_remove(&toplevel->link);
+	wl_list_init(&toplevel->link);
+	if (next != &server->toplevels) {
+		arrange_toplevels(server, wl_container_of(next, toplevel, link));
+	}
+	update_toplevel_index(server);
+}
+
+/* Put @toplevel in the place of @old, which is taken out of the layout */
+void
+layout_replace(struct toplevel *old, struct toplevel *toplevel)
+{
+	struct server *server = toplevel->server;
+	wl_list_insert(&old->link, &toplevel->link);
+	wl_list_remove(&old->link);
+	wl_list_init(&old->link);
+	arrange_toplevels(server, toplevel);
+	update_toplevel_index(server);
+}
+
+/*
+ * Move @toplevel to @index in layout order, or to the end if there are fewer
+ * toplevels. Everything between the old and the new place shifts, so they
+ * are re-arranged from whichever comes first.
+ */
+void
+layout_move(struct toplevel *toplevel, int index)
+{
+	struct server *server = toplevel->server;
+	int old_index = 0;
+	for (struct wl_list *link = server->toplevels.next; link != &toplevel->link;
+			link = link->next) {
+		old_index++;
+	}
+	wl_list_remove(&toplevel->link);
+
+	struct wl_list *prev = &server->toplevels;
+	for (int i = 0; i < index && prev->next != &server->toplevels; i++) {
+		prev = prev->next;
+	}
+	wl_list_insert(prev, &toplevel->link);
+
+	struct toplevel *start = toplevel;
+	if (old_index < index) {
+		struct wl_list *link = server->toplevels.next;
+		for (int i = 0; i < old_index; i++) {
+			link = link->next;
+		}
+		start = wl_container_of(link, start, link);
+	}
+	arrange_toplevels(server, start);
+	update_toplevel_index(server);
+}
+
+void
+layout_set_geometry(struct toplevel *toplevel, const struct wlr_box *geometry)
+{
+	/*
+	 * Most commits are just new content, so only re-arrange when the width
+	 * has changed because nothing else affects the layout.
+	 */
+	bool width_changed = geometry->width != toplevel->geometry.width;
+	bool offset_changed = geometry->x != toplevel->geometry.x
+		|| geometry->y != toplevel->geometry.y;
+	toplevel->geometry = *geometry;
+	if (width_changed) {
+		arrange_toplevels(toplevel->server, toplevel);
+	} else if (offset_changed) {
+		/* The surface moves within its slot */
+		passthrough_move(toplevel);
+	}
+}
+
+const char *
+toplevel_app_id(struct toplevel *toplevel)
+{
+	if (toplevel->native) {
+		return native_plugin_name(toplevel);
+	}
+	if (toplevel->ghost) {
+		return ghost_app_id(toplevel);
+	}
+	return toplevel->xdg_toplevel->app_id ? toplevel->xdg_toplevel->app_id : "n/a";
+}
+
+void
+layout_init(struct server *server)
+{
+	wl_list_init(&server->toplevels);
+	wl_array_init(&server->toplevel_index);
+}
@@ -1,14 +1,33 @@
 #include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
 #include "panel.h"
 
-static struct wlr_scene_output *scene_output;
-static struct wl_listener output_frame;
-
+/*
+ * Find the plugin under the cursor by a binary search of the toplevel index
+ * and then only search the scene-graph of that plugin for the surface, which
+ * may be a subsurface or popup.
+ */
 static struct
 toplevel *toplevel_at(struct server *server, double lx, double ly,
 		struct wlr_surface **surface, double *sx, double *sy)
 {
-	struct wlr_scene_node *node = wlr_scene_node_at(&server->scene->tree.node, lx, ly, sx, sy);
+	struct toplevel *toplevel = toplevel_index_lookup(server, lx);
+	if (!toplevel) {
+		return NULL;
+	}
+	if (toplevel->native) {
+		/* Drawn by the panel itself, so there is no surface to focus */
+		*surface = NULL;
+		return toplevel;
+	}
+	if (passthrough_surface_at(toplevel, lx, ly, surface, sx, sy)) {
+		return *surface ? toplevel : NULL;
+	}
+	struct wlr_scene_node *node =
+		wlr_scene_node_at(&toplevel->scene_tree->node, lx, ly, sx, sy);
 	if (!node || node->type != WLR_SCENE_NODE_BUFFER) {
 		return NULL;
 	}
@@ -18,20 +37,7 @@ toplevel *toplevel_at(struct server *server, double lx, double ly,
 		return NULL;
 	}
 	*surface = scene_surface->surface;
-	struct wlr_scene_tree *tree = node->parent;
-	while (tree && !tree->node.data) {
-		tree = tree->node.parent;
-	}
-	return tree->node.data;
-}
-
-static void
-output_handle_frame(struct wl_listener *listener, void *data)
-{
-	wlr_scene_output_commit(scene_output, NULL);
-	struct timespec now;
-	clock_gettime(CLOCK_MONOTONIC, &now);
-	wlr_scene_output_send_frame_done(scene_output, &now);
+	return toplevel;
 }
 
 static void
@@ -77,11 +83,15 @@ process_cursor_motion(struct frontend *frontend, uint32_t time)
 	if (!toplevel) {
 		wlr_cursor_set_xcursor(frontend->cursor, frontend->cursor_mgr, "default");
 	}
+	native_pointer_motion(frontend->server, toplevel,
+		frontend->cursor->x, frontend->cursor->y);
 	if (surface) {
-		fprintf(stderr, "info: '%s()'; surface=%p\n",
-			"wlr_seat_pointer_notify_enter", surface);
-		wlr_seat_pointer_notify_enter(seat, surface, sx, sy);
+		if (surface != seat->pointer_state.focused_surface) {
+			wlr_seat_pointer_notify_enter(seat, surface, sx, sy);
+		}
 		wlr_seat_pointer_notify_motion(seat, time, sx, sy);
+		stats_input_delivered(frontend->server);
+		trace_instant(TRACE_INPUT_DELIVERED, time);
 	} else {
 		wlr_seat_pointer_clear_focus(seat);
 	}
@@ -108,27 +118,23 @@ frontend_cursor_motion_absolute(struct wl_listener *listener, void *data)
 static void
 frontend_cursor_button(struct wl_listener *listener, void *data)
 {
-	fprintf(stderr, "info: '%s()'\n", __func__);
 	struct frontend *frontend = wl_container_of(listener, frontend, cursor_button);
 	struct wlr_pointer_button_event *event = data;
 	wlr_seat_pointer_notify_button(frontend->wlr_seat, event->time_msec,
 		event->button, event->state);
-
-	fprintf(stderr, "frontend->wlr_seat->pointer_state.focused_surface=%p\n",
-		frontend->wlr_seat->pointer_state.focused_surface);
+	if (frontend->wlr_seat->pointer_state.focused_surface) {
+		stats_input_delivered(frontend->server);
+		trace_instant(TRACE_INPUT_DELIVERED, event->time_msec);
+	}
 
 	double sx, sy;
 	struct wlr_surface *surface = NULL;
 	struct toplevel *toplevel = toplevel_at(frontend->server,
 		frontend->cursor->x, frontend->cursor->y, &surface, &sx, &sy);
 
-	fprintf(stderr, "info: 'sx=%f; sy=%f; app_id=%s; surface=%p\n", sx, sy,
-		toplevel ? toplevel->xdg_toplevel->app_id : "n/a", surface);
-
-	if (event->state == WL_POINTER_BUTTON_STATE_RELEASED) {
-		;
-	} else {
-		;
+	if (toplevel && toplevel->native) {
+		native_pointer_button(toplevel, frontend->cursor->x, frontend->cursor->y,
+			event->button, event->state == WL_POINTER_BUTTON_STATE_PRESSED);
 	}
 }
 
@@ -155,11 +161,6 @@ init_frontend(struct server *server, struct frontend *frontend)
 	frontend->scene_layout =
 		wlr_scene_attach_output_layout(server->scene, frontend->output_layout);
 
-	struct wlr_output_layout_output *l_output =
-		wlr_output_layout_add_auto(frontend->output_layout, frontend->wlr_output);
-	scene_output = wlr_scene_output_create(server->scene, frontend->wlr_output);
-	wlr_scene_output_layout_add_output(frontend->scene_layout, l_output, scene_output);
-
 	wlr_cursor_attach_output_layout(frontend->cursor, frontend->output_layout);
 
 	frontend->cursor_motion.notify = frontend_cursor_motion;
@@ -185,39 +186,275 @@ init_frontend(struct server *server, struct frontend *frontend)
 		&frontend->request_set_selection);
 }
 
+/* A non-negative decimal integer and nothing else */
+bool
+parse_int(const char *str, int *value)
+{
+	char *end;
+	errno = 0;
+	long n = strtol(str, &end, 10);
+	if (errno || end == str || *end || n < 0 || n > INT32_MAX) {
+		return false;
+	}
+	*value = n;
+	return true;
+}
+
+bool
+parse_color(const char *str, uint32_t *rgba)
+{
+	size_t len = strlen(str);
+	if (str[0] != '#' || (len != 7 && len != 9)) {
+		return false;
+	}
+	char *end;
+	unsigned long value = strtoul(str + 1, &end, 16);
+	if (*end) {
+		return false;
+	}
+	*rgba = len == 7 ? (uint32_t)value << 8 | 0xff : (uint32_t)value;
+	return true;
+}
+
+/*
+ * The reference clock, see plugins/clock.c, is built into plugins/ next to
+ * the panel executable. Plugin commands are split on whitespace, so if that
+ * path is not usable, clock.py relative to the working directory is started
+ * instead.
+ */
 static void
-spawn(const char *command)
+add_default_plugins(struct server *server)
 {
-	const char *shell = "/bin/sh";
-	if (!fork()) {
-		execl(shell, shell, "-c", command, (void *)NULL);
+	static const char *const colors[] = { "red", "blue", "green" };
+	const char *clock = "./plugins/clock.py";
+	char dir[PATH_MAX];
+	char path[PATH_MAX + 16];
+	ssize_t len = readlink("/proc/self/exe", dir, sizeof(dir) - 1);
+	if (len > 0) {
+		dir[len] = '\0';
+		char *slash = strrchr(dir, '/');
+		if (slash) {
+			*slash = '\0';
+		}
+		snprintf(path, sizeof(path), "%s/plugins/clock", dir);
+		if (!strpbrk(path, " \t") && !access(path, X_OK)) {
+			clock = path;
+		}
 	}
+	for (size_t i = 0; i < sizeof(colors) / sizeof(colors[0]); i++) {
+		char command[sizeof(path) + 32];
+		snprintf(command, sizeof(command), "%s --color %s", clock, colors[i]);
+		supervisor_add(server, command);
+	}
+}
+
+/* Leave the event loop so recordings and plugins are cleaned up */
+static int
+handle_terminate(int signal, void *data)
+{
+	struct wl_display *display = data;
+	wl_display_terminate(display);
+	return 0;
 }
 
+static const struct option long_options[] = {
+	{"autohide", no_argument, NULL, 'a'},
+	{"background", required_argument, NULL, 'b'},
+	{"egl-background", no_argument, NULL, 'e'},
+	{"help", no_argument, NULL, 'h'},
+	{"max-commit-rate", required_argument, NULL, 'c'},
+	{"native-plugin", required_argument, NULL, 'n'},
+	{"passthrough", no_argument, NULL, 'P'},
+	{"plugin", required_argument, NULL, 'p'},
+	{"raw-pointer-motion", no_argument, NULL, 'r'},
+	{"record-input", required_argument, NULL, 'R'},
+	{"replay-input", required_argument, NULL, 'I'},
+	{"shm-budget", required_argument, NULL, 'm'},
+	{"startup-deadline", required_argument, NULL, 'd'},
+	{"trace", required_argument, NULL, 't'},
+	{0, 0, 0, 0}
+};
+
+static const char usage[] =
+"Usage: carthusian [options...]\n"
+"  -a, --autohide             Shrink the panel to a strip while the pointer\n"
+"                             is elsewhere\n"
+"  -b, --background <color>   Background color as #rrggbb or #rrggbbaa\n"
+"  -c, --max-commit-rate <hz>\n"
+"                             Hold back frame callbacks of plugins to keep\n"
+"                             them under this many commits per second\n"
+"  -d, --startup-deadline <ms>\n"
+"                             Show the panel after this long even if not all\n"
+"                             plugins have mapped yet (default 1000)\n"
+"  -e, --egl-background       Draw the background with EGL/GLES\n"
+"  -h, --help                 Show help message and quit\n"
+"  -m, --shm-budget <size>[:warn|reject|disconnect]\n"
+"                             Limit the shm memory of each plugin, in bytes\n"
+"                             or with a K, M or G suffix; over budget plugins\n"
+"                             are warned about (default), hidden until back\n"
+"                             within budget, or disconnected\n"
+"  -n, --native-plugin <cmd>  Load shared object plugin, followed by optional\n"
+"                             arguments; may be given more than once\n"
+"  -P, --passthrough          Forward plugin buffers to the remote compositor\n"
+"                             instead of compositing them\n"
+"  -p, --plugin <cmd>         Start and supervise plugin; may be given more\n"
+"                             than once\n"
+"  -r, --raw-pointer-motion   Forward every pointer motion event to plugins\n"
+"                             instead of one per pointer frame\n"
+"  -R, --record-input <file>  Record remote pointer events to file\n"
+"  -I, --replay-input <file>[:<speed>]\n"
+"                             Replay recorded pointer events once the panel\n"
+"                             is shown, optionally sped up, then dump stats\n"
+"  -t, --trace <file>[:<records>]\n"
+"                             Keep a ring of recent trace events and write it\n"
+"                             to file as Chrome trace JSON on SIGUSR2 and exit\n";
+
 int
 main(int argc, char **argv)
 {
+	struct server server = {0};
+	clock_gettime(CLOCK_MONOTONIC, &server.stats.start_time);
 	wlr_log_init(WLR_ERROR, NULL);
 
-	struct server server = {0};
 	server.height = 40;
+	server.background = 0x222222ff;
+
+	struct wl_array native_plugins;
+	wl_array_init(&native_plugins);
+	struct wl_array plugins;
+	wl_array_init(&plugins);
+	int startup_deadline_ms = 1000;
+
+	int c;
+	while ((c = getopt_long(argc, argv, "ab:c:d:ehI:m:n:Pp:rR:t:", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'a':
+			server.autohide = true;
+			break;
+		case 'b':
+			if (!parse_color(optarg, &server.background)) {
+				fprintf(stderr, "fatal: invalid color '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'c':
+			if (!parse_int(optarg, &server.max_commit_rate)) {
+				fprintf(stderr, "fatal: invalid max commit rate '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'd':
+			if (!parse_int(optarg, &startup_deadline_ms)) {
+				fprintf(stderr, "fatal: invalid startup deadline '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'e':
+			server.egl_background = true;
+			break;
+		case 'm':
+			if (!shm_budget_parse(&server, optarg)) {
+				fprintf(stderr, "fatal: invalid shm budget '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'n': {
+			const char **command = wl_array_add(&native_plugins, sizeof(*command));
+			if (command) {
+				*command = optarg;
+			}
+			break;
+		}
+		case 'P':
+			server.passthrough = true;
+			break;
+		case 'p': {
+			const char **command = wl_array_add(&plugins, sizeof(*command));
+			if (command) {
+				*command = optarg;
+			}
+			break;
+		}
+		case 'r':
+			server.raw_pointer_motion = true;
+			break;
+		case 'R':
+			if (!input_record_open(&server, optarg)) {
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'I':
+			if (!input_replay_open(&server, optarg)) {
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 't':
+			if (!trace_open(optarg)) {
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'h':
+			printf("%s", usage);
+			exit(EXIT_SUCCESS);
+		default:
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_FAILURE);
+		}
+	}
 
+	/* Only asks for the remote globals, see backend_wait_globals() */
 	struct backend backend = {0};
 	backend_init(&server, &backend);
 
 	struct wl_display *local_display = wl_display_create();
 	struct wl_event_loop *event_loop = wl_display_get_event_loop(local_display);
+	/* Before any client can connect */
+	shm_budget_init(&server, local_display);
+
+	struct frontend frontend = {0};
+	frontend.local_display = local_display;
+	server.frontend = &frontend;
+
+	/*
+	 * Plugins take far longer to start than the panel, so they are started
+	 * first. Their connections are only served once the event loop runs, by
+	 * which time all globals exist.
+	 */
+	const char *socket = wl_display_add_socket_auto(local_display);
+	setenv("WAYLAND_DISPLAY", socket, true);
+	fprintf(stderr, "info: carthusian running on WAYLAND_DISPLAY=%s\n", socket);
+
+	supervisor_init(&server);
+	if (!plugins.size) {
+		add_default_plugins(&server);
+	}
+	const char **command;
+	wl_array_for_each(command, &plugins) {
+		supervisor_add(&server, *command);
+	}
+	wl_array_release(&plugins);
+	supervisor_start(&server);
 
 	backend.wlr_backend = wlr_wl_backend_create(event_loop, backend.remote_display);
 
 	struct wlr_renderer *renderer = wlr_renderer_autocreate(backend.wlr_backend);
 	wlr_renderer_init_wl_display(renderer, local_display);
-	struct wlr_allocator *allocator = wlr_allocator_autocreate(backend.wlr_backend, renderer);
-	struct wlr_compositor *wlr_compositor = wlr_compositor_create(local_display, 5, renderer);
+	backend.renderer = renderer;
+	backend.allocator = wlr_allocator_autocreate(backend.wlr_backend, renderer);
+	struct wlr_compositor *wlr_compositor = wlr_compositor_create(local_display, 6, renderer);
 	server.scene = wlr_scene_create();
 
-	struct frontend frontend = {0};
-	frontend.local_display = local_display;
+	/*
+	 * The scene tells plugins the scale of the panel they are shown on, so
+	 * they can draw at native resolution
+	 */
+	wlr_fractional_scale_manager_v1_create(local_display, 1);
+	wlr_viewporter_create(local_display);
+
+	/* Plugins get the remote compositor's presentation timing */
+	struct wlr_presentation *presentation =
+		wlr_presentation_create(local_display, backend.wlr_backend);
+	wlr_scene_set_presentation(server.scene, presentation);
 
 	/* Need to rig up the new_input listener before starting the backend */
 	frontend.cursor = wlr_cursor_create();
@@ -231,55 +468,41 @@ main(int argc, char **argv)
 	frontend.new_input.notify = frontend_new_input;
 	wl_signal_add(&backend.wlr_backend->events.new_input, &frontend.new_input);
 
+	backend_wait_globals(&backend);
 	wlr_backend_start(backend.wlr_backend);
 
-	backend.main_surface = wl_compositor_create_surface(backend.compositor);
-
-	backend_layer_shell_init(&backend);
-
-	backend.egl.window = wl_egl_window_create(backend.main_surface, server.width, server.height);
-	backend.egl.surface = eglCreatePlatformWindowSurface(backend.egl.display,
-		backend.egl.config, backend.egl.window, NULL);
-	wl_display_roundtrip(backend.remote_display);
-
-	struct wl_surface *child_surface = wl_compositor_create_surface(backend.compositor);
-	struct wl_subsurface *subsurface = wl_subcompositor_get_subsurface(backend.subcompositor,
-		child_surface, backend.main_surface);
-
-	/* This is where the magic happens */
-	wl_subsurface_set_position(subsurface, 0, 0);
-	frontend.wlr_output = wlr_wl_output_create_from_surface(backend.wlr_backend, child_surface);
-	wlr_output_init_render(frontend.wlr_output, allocator, renderer);
-
-	output_frame.notify = output_handle_frame;
-	wl_signal_add(&frontend.wlr_output->events.frame, &output_frame);
-
-	/* Sync output size to panel size */
-	struct wlr_output_state output_state;
-	wlr_output_state_init(&output_state);
-	wlr_output_state_set_enabled(&output_state, true);
-	wlr_output_state_set_custom_mode(&output_state, server.width, server.height, 0);
-	wlr_output_commit_state(frontend.wlr_output, &output_state);
-	wlr_output_state_finish(&output_state);
-
 	init_frontend(&server, &frontend);
 
+	/* One panel and nested output for each remote output */
+	panel_start(&server);
+
 	/* Setup Wayland protocol xdg-shell for plugin windows */
-	wl_list_init(&server.toplevels);
+	layout_init(&server);
+	transaction_init(&server, event_loop);
 	xdg_shell_init(&server, server.frontend->local_display);
 
-	const char *socket = wl_display_add_socket_auto(local_display);
-	setenv("WAYLAND_DISPLAY", socket, true);
-	fprintf(stderr, "info: carthusian running on WAYLAND_DISPLAY=%s\n", socket);
+	stats_init(&server, event_loop);
+	trace_init(event_loop);
+	control_init(&server, event_loop);
+	wl_event_loop_add_signal(event_loop, SIGINT, handle_terminate, local_display);
+	wl_event_loop_add_signal(event_loop, SIGTERM, handle_terminate, local_display);
+
+	wl_array_for_each(command, &native_plugins) {
+		native_plugin_load(&server, *command);
+	}
+	wl_array_release(&native_plugins);
 
-	spawn("./plugins/clock.py --color red");
-	spawn("./plugins/clock.py --color blue");
-	spawn("./plugins/clock.py --color green");
+	supervisor_wait(&server, startup_deadline_ms);
 
-	render(&server);
+	render_schedule(&server);
 
 	wl_display_run(local_display);
 
+	control_finish(&server);
+	input_finish(&server);
+	trace_finish();
+	supervisor_finish(&server);
+	panel_finish(&server);
 	backend_finish(&backend);
 	return 0;
 }
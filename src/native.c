@@ -0,0 +1,473 @@
+#include <dlfcn.h>
+#include <drm_fourcc.h>
+#include <wlr/interfaces/wlr_buffer.h>
+#include "carthusian-native.h"
+#include "panel.h"
+
+/*
+ * Native plugins are loaded with dlopen() and draw into memory buffers which
+ * are shown through a wlr_scene_buffer. They take part in the layout like any
+ * xdg-shell plugin by owning a struct toplevel with a NULL xdg_toplevel.
+ *
+ * Plugins which take a scale draw in buffer pixels, and the scene-buffer
+ * shows that at the configured size, so HiDPI panels are not upscaled.
+ */
+
+#define NATIVE_BUFFERS (3)
+
+struct native_buffer {
+	struct wlr_buffer base;
+	void *data;
+	size_t stride;
+};
+
+struct carthusian_native_timer {
+	struct native *native;
+	struct wl_event_source *source;
+	void (*callback)(void *data);
+	void *data;
+	struct wl_list link; /* native.timers */
+};
+
+struct native {
+	struct toplevel toplevel;
+
+	void *handle;
+	const struct carthusian_native_plugin *plugin;
+	void *data;
+
+	struct wlr_scene_buffer *scene_buffer;
+	struct native_buffer *buffers[NATIVE_BUFFERS];
+	/* Granted size, and what the plugin last asked for */
+	int width, height;
+	int request_width, request_height;
+	/* Buffers are this much larger than width and height */
+	double scale;
+
+	struct wl_event_source *idle_draw;
+	/* A draw was skipped while suspended */
+	bool draw_deferred;
+	struct wl_list timers;
+};
+
+/* Native plugin which currently has pointer focus */
+static struct native *pointer_focus;
+
+static void
+native_buffer_destroy(struct wlr_buffer *wlr_buffer)
+{
+	struct native_buffer *buffer = wl_container_of(wlr_buffer, buffer, base);
+	free(buffer->data);
+	free(buffer);
+}
+
+static bool
+native_buffer_begin_data_ptr_access(struct wlr_buffer *wlr_buffer, uint32_t flags,
+		void **data, uint32_t *format, size_t *stride)
+{
+	struct native_buffer *buffer = wl_container_of(wlr_buffer, buffer, base);
+	*data = buffer->data;
+	*format = DRM_FORMAT_ARGB8888;
+	*stride = buffer->stride;
+	return true;
+}
+
+static void
+native_buffer_end_data_ptr_access(struct wlr_buffer *wlr_buffer)
+{
+	/* no-op */
+}
+
+static const struct wlr_buffer_impl native_buffer_impl = {
+	.destroy = native_buffer_destroy,
+	.begin_data_ptr_access = native_buffer_begin_data_ptr_access,
+	.end_data_ptr_access = native_buffer_end_data_ptr_access,
+};
+
+static struct native_buffer *
+native_buffer_create(int width, int height)
+{
+	struct native_buffer *buffer = calloc(1, sizeof(*buffer));
+	if (!buffer) {
+		return NULL;
+	}
+	buffer->stride = width * 4;
+	buffer->data = calloc(height, buffer->stride);
+	if (!buffer->data) {
+		free(buffer);
+		return NULL;
+	}
+	wlr_buffer_init(&buffer->base, &native_buffer_impl, width, height);
+	return buffer;
+}
+
+static void
+release_buffers(struct native *native)
+{
+	for (int i = 0; i < NATIVE_BUFFERS; i++) {
+		if (native->buffers[i]) {
+			wlr_buffer_drop(&native->buffers[i]->base);
+			native->buffers[i] = NULL;
+		}
+	}
+}
+
+/*
+ * The scene-graph keeps the buffer on screen locked, so draw into one which
+ * nobody else holds. Each draw then shows a different wlr_buffer, which means
+ * the renderer never samples from a buffer while it is being drawn into.
+ */
+static struct native_buffer *
+get_free_buffer(struct native *native)
+{
+	for (int i = 0; i < NATIVE_BUFFERS; i++) {
+		if (!native->buffers[i]) {
+			native->buffers[i] = native_buffer_create(
+				(int)(native->width * native->scale + 0.5),
+				(int)(native->height * native->scale + 0.5));
+			return native->buffers[i];
+		}
+		if (native->buffers[i]->base.n_locks == 0) {
+			return native->buffers[i];
+		}
+	}
+	return NULL;
+}
+
+static void
+draw(void *data)
+{
+	struct native *native = data;
+	native->idle_draw = NULL;
+	if (native->width <= 0 || native->height <= 0) {
+		return;
+	}
+	if (native->toplevel.server->suspended) {
+		/* Nobody would see it; draw once the panel is visible again */
+		native->draw_deferred = true;
+		return;
+	}
+	struct native_buffer *buffer = get_free_buffer(native);
+	if (!buffer) {
+		fprintf(stderr, "warn: no free buffer for native plugin '%s'\n",
+			native->plugin->name);
+		return;
+	}
+	trace_begin(TRACE_NATIVE_DRAW, 0);
+	native->plugin->draw(native->data, buffer->data, buffer->base.width,
+		buffer->base.height, buffer->stride);
+	trace_end(TRACE_NATIVE_DRAW);
+	wlr_scene_buffer_set_buffer(native->scene_buffer, &buffer->base);
+	wlr_scene_buffer_set_dest_size(native->scene_buffer, native->width,
+		native->height);
+	stats_toplevel_commit(&native->toplevel);
+}
+
+static void
+host_schedule_draw(struct carthusian_native_host *host)
+{
+	struct native *native = (struct native *)host;
+	if (native->idle_draw) {
+		return;
+	}
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(native->toplevel.server->frontend->local_display);
+	native->idle_draw = wl_event_loop_add_idle(loop, draw, native);
+}
+
+/* Grant the requested size as far as the panel height allows */
+static void
+apply_size(struct native *native)
+{
+	struct server *server = native->toplevel.server;
+	int width = native->request_width;
+	int height = native->request_height;
+
+	if (height > server->height - 2 * MARGIN_HORIZONTAL) {
+		height = server->height - 2 * MARGIN_HORIZONTAL;
+	}
+	if (width < 0 || height < 0) {
+		width = height = 0;
+	}
+	if (width == native->width && height == native->height) {
+		return;
+	}
+	native->width = width;
+	native->height = height;
+	release_buffers(native);
+
+	/* During create() the plugin is configured once that has returned */
+	if (native->data) {
+		native->plugin->configure(native->data, width, height);
+	}
+	struct wlr_box geometry = { .width = width, .height = height };
+	layout_set_geometry(&native->toplevel, &geometry);
+	host_schedule_draw((struct carthusian_native_host *)native);
+}
+
+static void
+host_set_size(struct carthusian_native_host *host, int width, int height)
+{
+	struct native *native = (struct native *)host;
+	native->request_width = width;
+	native->request_height = height;
+	apply_size(native);
+}
+
+static int
+handle_timer(void *data)
+{
+	struct carthusian_native_timer *timer = data;
+	timer->callback(timer->data);
+	return 0;
+}
+
+static struct carthusian_native_timer *
+host_timer_add(struct carthusian_native_host *host, void (*callback)(void *data),
+		void *data)
+{
+	struct native *native = (struct native *)host;
+	struct carthusian_native_timer *timer = calloc(1, sizeof(*timer));
+	if (!timer) {
+		return NULL;
+	}
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(native->toplevel.server->frontend->local_display);
+	timer->source = wl_event_loop_add_timer(loop, handle_timer, timer);
+	if (!timer->source) {
+		free(timer);
+		return NULL;
+	}
+	timer->native = native;
+	timer->callback = callback;
+	timer->data = data;
+	wl_list_insert(&native->timers, &timer->link);
+	return timer;
+}
+
+static void
+host_timer_update(struct carthusian_native_timer *timer, int timeout_ms)
+{
+	wl_event_source_timer_update(timer->source, timeout_ms);
+}
+
+static void
+host_timer_remove(struct carthusian_native_timer *timer)
+{
+	wl_event_source_remove(timer->source);
+	wl_list_remove(&timer->link);
+	free(timer);
+}
+
+static const struct carthusian_native_host_api host_api = {
+	.abi_version = CARTHUSIAN_NATIVE_ABI_VERSION,
+	.set_size = host_set_size,
+	.schedule_draw = host_schedule_draw,
+	.timer_add = host_timer_add,
+	.timer_update = host_timer_update,
+	.timer_remove = host_timer_remove,
+};
+
+const char *
+native_plugin_name(struct toplevel *toplevel)
+{
+	struct native *native = wl_container_of(toplevel, native, toplevel);
+	return native->plugin->name;
+}
+
+void
+native_pointer_motion(struct server *server, struct toplevel *toplevel,
+		double lx, double ly)
+{
+	struct native *native = NULL;
+	if (toplevel && toplevel->native) {
+		native = wl_container_of(toplevel, native, toplevel);
+	}
+	if (pointer_focus && pointer_focus != native) {
+		if (pointer_focus->plugin->pointer_leave) {
+			pointer_focus->plugin->pointer_leave(pointer_focus->data);
+		}
+	}
+	pointer_focus = native;
+	if (native && native->plugin->pointer_motion) {
+		struct wlr_scene_node *node = &toplevel->scene_tree->node;
+		native->plugin->pointer_motion(native->data, lx - node->x, ly - node->y);
+	}
+}
+
+void
+native_pointer_button(struct toplevel *toplevel, double lx, double ly,
+		uint32_t button, bool pressed)
+{
+	struct native *native = wl_container_of(toplevel, native, toplevel);
+	if (native->plugin->pointer_button) {
+		struct wlr_scene_node *node = &toplevel->scene_tree->node;
+		native->plugin->pointer_button(native->data, lx - node->x, ly - node->y,
+			button, pressed);
+	}
+}
+
+/*
+ * Load a native plugin from @command which is the path of the shared object
+ * optionally followed by a space and arguments for the plugin.
+ */
+void
+native_plugin_load(struct server *server, const char *command)
+{
+	char *path = strdup(command);
+	if (!path) {
+		return;
+	}
+	char *args = strchr(path, ' ');
+	if (args) {
+		*args++ = '\0';
+	}
+
+	void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!handle) {
+		fprintf(stderr, "warn: cannot load native plugin: %s\n", dlerror());
+		goto out;
+	}
+	carthusian_native_entry_t entry =
+		(carthusian_native_entry_t)dlsym(handle, CARTHUSIAN_NATIVE_ENTRY);
+	const struct carthusian_native_plugin *plugin = entry ? entry() : NULL;
+	if (!plugin) {
+		fprintf(stderr, "warn: '%s' is not a native plugin\n", path);
+		dlclose(handle);
+		goto out;
+	}
+	if (plugin->abi_version != CARTHUSIAN_NATIVE_ABI_VERSION) {
+		fprintf(stderr, "warn: native plugin '%s' has ABI version %u; want %u\n",
+			path, plugin->abi_version, CARTHUSIAN_NATIVE_ABI_VERSION);
+		dlclose(handle);
+		goto out;
+	}
+
+	struct native *native = calloc(1, sizeof(*native));
+	if (!native) {
+		dlclose(handle);
+		goto out;
+	}
+	native->handle = handle;
+	native->plugin = plugin;
+	native->scale = 1;
+	wl_list_init(&native->timers);
+
+	struct toplevel *toplevel = &native->toplevel;
+	toplevel->server = server;
+	toplevel->native = native;
+	toplevel->scene_tree = wlr_scene_tree_create(&server->scene->tree);
+	toplevel->scene_tree->node.data = toplevel;
+	native->scene_buffer = wlr_scene_buffer_create(toplevel->scene_tree, NULL);
+	layout_add(toplevel);
+
+	native->data = plugin->create((struct carthusian_native_host *)native, &host_api,
+		args ? args : "");
+	if (!native->data) {
+		fprintf(stderr, "warn: native plugin '%s' failed to start\n", path);
+		native_plugin_unload(toplevel);
+		goto out;
+	}
+	apply_scale(native, server_scale(server));
+	if (native->width > 0 && native->height > 0) {
+		plugin->configure(native->data, native->width, native->height);
+	}
+	fprintf(stderr, "info: loaded native plugin '%s'\n", plugin->name);
+out:
+	free(path);
+}
+
+/*
+ * The panel height has changed, so re-grant each plugin what it asked for.
+ * A plugin asking for more than the old height grows with the panel.
+ */
+void
+native_set_height(struct server *server)
+{
+	struct toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->toplevels, link) {
+		if (toplevel->native) {
+			apply_size(toplevel->native);
+		}
+	}
+}
+
+/* Like wlr_scene does for surfaces, the highest scale of any panel */
+static double
+server_scale(struct server *server)
+{
+	double scale = 1;
+	struct panel *panel;
+	wl_list_for_each(panel, &server->panels, link) {
+		if (panel->scale > scale) {
+			scale = panel->scale;
+		}
+	}
+	return scale;
+}
+
+static void
+apply_scale(struct native *native, double scale)
+{
+	if (!native->plugin->set_scale || scale == native->scale) {
+		return;
+	}
+	native->scale = scale;
+	release_buffers(native);
+	native->plugin->set_scale(native->data, scale);
+	host_schedule_draw((struct carthusian_native_host *)native);
+}
+
+/* Called when the scale of a panel has changed or a panel went away */
+void
+native_set_scale(struct server *server)
+{
+	double scale = server_scale(server);
+	struct toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->toplevels, link) {
+		if (toplevel->native) {
+			apply_scale(toplevel->native, scale);
+		}
+	}
+}
+
+/* Draw what was skipped while the panel was not visible */
+void
+native_resume(struct server *server)
+{
+	struct toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->toplevels, link) {
+		if (!toplevel->native) {
+			continue;
+		}
+		struct native *native = wl_container_of(toplevel, native, toplevel);
+		if (native->draw_deferred) {
+			native->draw_deferred = false;
+			host_schedule_draw((struct carthusian_native_host *)native);
+		}
+	}
+}
+
+void
+native_plugin_unload(struct toplevel *toplevel)
+{
+	struct native *native = wl_container_of(toplevel, native, toplevel);
+	if (native->data) {
+		native->plugin->destroy(native->data);
+	}
+	if (pointer_focus == native) {
+		pointer_focus = NULL;
+	}
+	struct carthusian_native_timer *timer, *tmp;
+	wl_list_for_each_safe(timer, tmp, &native->timers, link) {
+		host_timer_remove(timer);
+	}
+	if (native->idle_draw) {
+		wl_event_source_remove(native->idle_draw);
+	}
+	layout_remove(toplevel);
+	wlr_scene_node_destroy(&toplevel->scene_tree->node);
+	release_buffers(native);
+	dlclose(native->handle);
+	free(native);
+}
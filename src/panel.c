@@ -0,0 +1,525 @@
+#include "panel.h"
+
+/*
+ * A panel is shown on every remote wl_output. Outputs announced before the
+ * frontend is up get their panel in panel_start(), hotplugged ones as soon as
+ * the wl_output global appears, and panels go away with their global.
+ *
+ * The nested outputs are all placed at 0,0 in the output layout, so every
+ * panel shows the same part of the shared scene-graph. Plugins are laid out
+ * once and do not know how many panels there are.
+ *
+ * With --autohide a panel shrinks to a strip of AUTOHIDE_HEIGHT pixels once
+ * the pointer has left it for AUTOHIDE_DELAY_MS, and its nested output is
+ * disabled so nothing is rendered while it is hidden. When no panel is
+ * visible, either hidden or occluded (see frame-clock.c), plugins are told
+ * they are suspended so they can stop drawing too.
+ */
+
+#define AUTOHIDE_HEIGHT (2)
+#define AUTOHIDE_DELAY_MS (500)
+
+static double
+panel_scale(struct panel *panel)
+{
+	if (panel->preferred_scale) {
+		return panel->preferred_scale / 120.0;
+	}
+	return panel->output_scale > 0 ? panel->output_scale : 1;
+}
+
+/*
+ * The nested output is given the remote output's scale and a mode in buffer
+ * pixels, rounded the way wp_fractional_scale_v1 asks for, and child_surface
+ * is shown at the logical size with wp_viewporter. Every pixel is then drawn
+ * once by the nested renderer and not scaled again by the remote compositor.
+ * Without wp_viewporter only integer scales can be expressed.
+ */
+static void
+panel_set_mode(struct panel *panel)
+{
+	if (!panel->wlr_output) {
+		return;
+	}
+	if (panel->autohidden) {
+		if (panel->mode_width) {
+			struct wlr_output_state state;
+			wlr_output_state_init(&state);
+			wlr_output_state_set_enabled(&state, false);
+			wlr_output_commit_state(panel->wlr_output, &state);
+			wlr_output_state_finish(&state);
+			/* Enabled again with the next full-size configure */
+			panel->mode_width = panel->mode_height = 0;
+		}
+		return;
+	}
+	if (!panel->width || !panel->height) {
+		return;
+	}
+	double scale = panel_scale(panel);
+	if (!panel->child_viewport) {
+		scale = (int)(scale + 0.5);
+	}
+	int width = (int)(panel->width * scale + 0.5);
+	int height = (int)(panel->height * scale + 0.5);
+	if (width == panel->mode_width && height == panel->mode_height
+			&& scale == panel->scale) {
+		return;
+	}
+	panel->mode_width = width;
+	panel->mode_height = height;
+	panel->scale = scale;
+
+	struct wlr_output_state state;
+	wlr_output_state_init(&state);
+	wlr_output_state_set_enabled(&state, true);
+	wlr_output_state_set_custom_mode(&state, width, height, 0);
+	wlr_output_state_set_scale(&state, scale);
+	wlr_output_commit_state(panel->wlr_output, &state);
+	wlr_output_state_finish(&state);
+
+	/* Both are latched by the next commit of the nested output */
+	if (panel->child_viewport) {
+		wp_viewport_set_destination(panel->child_viewport, panel->width,
+			panel->height);
+	} else {
+		wl_surface_set_buffer_scale(panel->child_surface, (int32_t)scale);
+	}
+	native_set_scale(panel->server);
+}
+
+static void
+fractional_scale_handle_preferred_scale(void *data,
+		struct wp_fractional_scale_v1 *fractional_scale, uint32_t scale)
+{
+	struct panel *panel = data;
+	panel->preferred_scale = scale;
+	panel_set_mode(panel);
+}
+
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener = {
+	.preferred_scale = fractional_scale_handle_preferred_scale,
+};
+
+static void
+output_handle_geometry(void *data, struct wl_output *wl_output, int32_t x, int32_t y,
+		int32_t physical_width, int32_t physical_height, int32_t subpixel,
+		const char *make, const char *model, int32_t transform)
+{
+}
+
+static void
+output_handle_mode(void *data, struct wl_output *wl_output, uint32_t flags,
+		int32_t width, int32_t height, int32_t refresh)
+{
+}
+
+static void
+output_handle_done(void *data, struct wl_output *wl_output)
+{
+	struct panel *panel = data;
+	if (panel->pending_output_scale != panel->output_scale) {
+		panel->output_scale = panel->pending_output_scale;
+		panel_set_mode(panel);
+	}
+}
+
+static void
+output_handle_scale(void *data, struct wl_output *wl_output, int32_t factor)
+{
+	struct panel *panel = data;
+	panel->pending_output_scale = factor;
+}
+
+static void
+output_handle_name(void *data, struct wl_output *wl_output, const char *name)
+{
+}
+
+static void
+output_handle_description(void *data, struct wl_output *wl_output,
+		const char *description)
+{
+}
+
+static const struct wl_output_listener output_listener = {
+	.geometry = output_handle_geometry,
+	.mode = output_handle_mode,
+	.done = output_handle_done,
+	.scale = output_handle_scale,
+	.name = output_handle_name,
+	.description = output_handle_description,
+};
+
+static void
+server_update_suspended(struct server *server)
+{
+	bool suspended = !wl_list_empty(&server->panels);
+	struct panel *panel;
+	wl_list_for_each(panel, &server->panels, link) {
+		if (!panel->occluded && !panel->autohidden) {
+			suspended = false;
+			break;
+		}
+	}
+	if (suspended == server->suspended) {
+		return;
+	}
+	server->suspended = suspended;
+	fprintf(stderr, "info: %s plugins\n", suspended ? "suspending" : "resuming");
+	xdg_shell_set_suspended(server, suspended);
+	if (!suspended) {
+		native_resume(server);
+	}
+}
+
+void
+panel_set_occluded(struct panel *panel, bool occluded)
+{
+	if (panel->occluded == occluded) {
+		return;
+	}
+	panel->occluded = occluded;
+	server_update_suspended(panel->server);
+}
+
+static void
+panel_set_autohidden(struct panel *panel, bool autohidden)
+{
+	struct server *server = panel->server;
+	if (panel->autohidden == autohidden) {
+		return;
+	}
+	panel->autohidden = autohidden;
+	zwlr_layer_surface_v1_set_size(panel->layer_surface, 0,
+		autohidden ? AUTOHIDE_HEIGHT : server->height);
+	wl_surface_commit(panel->main_surface);
+	if (autohidden) {
+		panel_set_mode(panel);
+	} else {
+		/* The remote frame callback was dropped with the nested output */
+		panel->occluded = false;
+	}
+	server_update_suspended(server);
+}
+
+static int
+handle_autohide_timeout(void *data)
+{
+	struct panel *panel = data;
+	panel_set_autohidden(panel, true);
+	return 0;
+}
+
+static struct panel *
+panel_from_surface(struct server *server, struct wl_surface *surface)
+{
+	struct panel *panel;
+	wl_list_for_each(panel, &server->panels, link) {
+		if (surface == panel->main_surface || surface == panel->child_surface) {
+			return panel;
+		}
+	}
+	/* Passthrough surfaces are only placed on the primary panel */
+	return surface ? panel_primary(server) : NULL;
+}
+
+void
+panel_pointer_enter(struct server *server, struct wl_surface *surface)
+{
+	struct panel *panel = panel_from_surface(server, surface);
+	if (!server->autohide || !panel || !panel->autohide_timer) {
+		return;
+	}
+	wl_event_source_timer_update(panel->autohide_timer, 0);
+	panel_set_autohidden(panel, false);
+}
+
+void
+panel_pointer_leave(struct server *server, struct wl_surface *surface)
+{
+	struct panel *panel = panel_from_surface(server, surface);
+	if (!server->autohide || !panel || !panel->autohide_timer) {
+		return;
+	}
+	wl_event_source_timer_update(panel->autohide_timer, AUTOHIDE_DELAY_MS);
+}
+
+/*
+ * Ask the remote compositor for a new height. Plugins are resized once its
+ * configure arrives, see transaction_panels_resized().
+ */
+void
+panel_set_height(struct server *server, int height)
+{
+	server->height = height;
+	struct panel *panel;
+	wl_list_for_each(panel, &server->panels, link) {
+		if (!panel->layer_surface) {
+			continue;
+		}
+		if (!panel->autohidden) {
+			zwlr_layer_surface_v1_set_size(panel->layer_surface, 0, height);
+		}
+		if (!server->autohide) {
+			zwlr_layer_surface_v1_set_exclusive_zone(panel->layer_surface, height);
+		}
+		wl_surface_commit(panel->main_surface);
+	}
+	/* xdg-shell plugins follow once the panels are configured */
+	native_set_height(server);
+}
+
+static void
+panel_init_egl(struct panel *panel)
+{
+	struct backend *backend = panel->server->backend;
+	panel->egl.window = wl_egl_window_create(panel->main_surface, panel->width,
+		panel->height);
+	panel->egl.surface = eglCreatePlatformWindowSurface(backend->egl.display,
+		backend->egl.config, panel->egl.window, NULL);
+	if (panel->egl.surface == EGL_NO_SURFACE) {
+		fprintf(stderr, "warn: cannot create EGL surface\n");
+	}
+}
+
+static void
+layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *layer_surface,
+		uint32_t serial, uint32_t width, uint32_t height)
+{
+	struct panel *panel = data;
+	trace_instant(TRACE_REMOTE_CONFIGURE, height);
+	bool resized = panel->width != (int)width || panel->height != (int)height;
+	panel->width = width;
+	panel->height = height;
+	zwlr_layer_surface_v1_ack_configure(layer_surface, serial);
+
+	if (panel->server->egl_background) {
+		if (!panel->egl.window) {
+			panel_init_egl(panel);
+		} else if (resized) {
+			wl_egl_window_resize(panel->egl.window, width, height, 0, 0);
+		}
+	}
+	/* Sync nested output and plugin size to panel size */
+	if (resized) {
+		panel_set_mode(panel);
+		transaction_panels_resized(panel->server);
+	}
+	render_panel_schedule(panel);
+}
+
+static void panel_destroy(struct panel *panel);
+
+static void
+layer_surface_closed(void *data, struct zwlr_layer_surface_v1 *layer_surface)
+{
+	struct panel *panel = data;
+	fprintf(stderr, "info: remote compositor closed a panel\n");
+	panel_destroy(panel);
+}
+
+static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
+	.configure = layer_surface_configure,
+	.closed = layer_surface_closed,
+};
+
+static void
+panel_setup(struct panel *panel)
+{
+	struct server *server = panel->server;
+	struct backend *backend = server->backend;
+	struct frontend *frontend = server->frontend;
+
+	panel->main_surface = wl_compositor_create_surface(backend->compositor);
+	panel->layer_surface = zwlr_layer_shell_v1_get_layer_surface(backend->layer_shell,
+		panel->main_surface, panel->wl_output, ZWLR_LAYER_SHELL_V1_LAYER_TOP,
+		"carthusian");
+	zwlr_layer_surface_v1_set_size(panel->layer_surface, 0, server->height);
+	zwlr_layer_surface_v1_set_anchor(panel->layer_surface,
+		ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT | ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM
+		| ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT);
+	/* An auto-hidden panel does not push windows away when shown */
+	zwlr_layer_surface_v1_set_exclusive_zone(panel->layer_surface,
+		server->autohide ? AUTOHIDE_HEIGHT : server->height);
+	zwlr_layer_surface_v1_set_keyboard_interactivity(panel->layer_surface,
+		ZWLR_LAYER_SURFACE_V1_KEYBOARD_INTERACTIVITY_NONE);
+	zwlr_layer_surface_v1_add_listener(panel->layer_surface, &layer_surface_listener,
+		panel);
+	if (backend->fractional_scale_manager) {
+		panel->fractional_scale = wp_fractional_scale_manager_v1_get_fractional_scale(
+			backend->fractional_scale_manager, panel->main_surface);
+		wp_fractional_scale_v1_add_listener(panel->fractional_scale,
+			&fractional_scale_listener, panel);
+	}
+	/* The size arrives with the configure event */
+	wl_surface_commit(panel->main_surface);
+
+	panel->child_surface = wl_compositor_create_surface(backend->compositor);
+	panel->subsurface = wl_subcompositor_get_subsurface(backend->subcompositor,
+		panel->child_surface, panel->main_surface);
+	/* The default, but the frame clock relies on it, see frame-clock.c */
+	wl_subsurface_set_sync(panel->subsurface);
+
+	if (backend->viewporter) {
+		panel->child_viewport = wp_viewporter_get_viewport(backend->viewporter,
+			panel->child_surface);
+	}
+
+	/* This is where the magic happens */
+	wl_subsurface_set_position(panel->subsurface, 0, 0);
+	panel->wlr_output = wlr_wl_output_create_from_surface(backend->wlr_backend,
+		panel->child_surface);
+	if (!panel->wlr_output) {
+		fprintf(stderr, "warn: cannot create nested output\n");
+		return;
+	}
+	wlr_output_init_render(panel->wlr_output, backend->allocator, backend->renderer);
+	frame_clock_init(panel);
+
+	struct wlr_output_layout_output *l_output =
+		wlr_output_layout_add(frontend->output_layout, panel->wlr_output, 0, 0);
+	panel->scene_output = wlr_scene_output_create(server->scene, panel->wlr_output);
+	wlr_scene_output_layout_add_output(frontend->scene_layout, l_output,
+		panel->scene_output);
+
+	/* In case the configure or scale arrived first */
+	panel_set_mode(panel);
+
+	if (server->autohide) {
+		/* Shown at first, hidden unless the pointer comes by */
+		struct wl_event_loop *loop =
+			wl_display_get_event_loop(frontend->local_display);
+		panel->autohide_timer =
+			wl_event_loop_add_timer(loop, handle_autohide_timeout, panel);
+		wl_event_source_timer_update(panel->autohide_timer, AUTOHIDE_DELAY_MS);
+	}
+}
+
+static void
+panel_destroy(struct panel *panel)
+{
+	struct server *server = panel->server;
+	wl_list_remove(&panel->link);
+
+	passthrough_panel_destroyed(panel);
+	stats_panel_destroyed(panel);
+	render_panel_finish(panel);
+
+	if (panel->autohide_timer) {
+		wl_event_source_remove(panel->autohide_timer);
+	}
+	if (panel->wlr_output) {
+		frame_clock_finish(panel);
+		/* Takes the scene output and the output layout entry with it */
+		wlr_output_destroy(panel->wlr_output);
+	}
+	if (panel->child_viewport) {
+		wp_viewport_destroy(panel->child_viewport);
+	}
+	if (panel->fractional_scale) {
+		wp_fractional_scale_v1_destroy(panel->fractional_scale);
+	}
+	if (panel->subsurface) {
+		wl_subsurface_destroy(panel->subsurface);
+	}
+	if (panel->child_surface) {
+		wl_surface_destroy(panel->child_surface);
+	}
+	if (panel->layer_surface) {
+		zwlr_layer_surface_v1_destroy(panel->layer_surface);
+	}
+	if (panel->main_surface) {
+		wl_surface_destroy(panel->main_surface);
+	}
+	wl_output_release(panel->wl_output);
+	free(panel);
+
+	if (wl_list_empty(&server->panels)) {
+		fprintf(stderr, "info: no remote outputs left, waiting for one\n");
+	}
+	server_update_suspended(server);
+	native_set_scale(server);
+}
+
+void
+panel_add(struct server *server, uint32_t global_name, struct wl_output *wl_output)
+{
+	struct panel *panel = calloc(1, sizeof(*panel));
+	if (!panel) {
+		wl_output_release(wl_output);
+		return;
+	}
+	panel->server = server;
+	panel->global_name = global_name;
+	panel->wl_output = wl_output;
+	wl_output_add_listener(wl_output, &output_listener, panel);
+	wl_list_insert(server->panels.prev, &panel->link);
+
+	if (server->backend->started) {
+		panel_setup(panel);
+	}
+}
+
+void
+panel_remove(struct server *server, uint32_t global_name)
+{
+	struct panel *panel;
+	wl_list_for_each(panel, &server->panels, link) {
+		if (panel->global_name == global_name) {
+			panel_destroy(panel);
+			return;
+		}
+	}
+}
+
+void
+panel_start(struct server *server)
+{
+	struct backend *backend = server->backend;
+	if (!backend->compositor || !backend->subcompositor || !backend->layer_shell) {
+		fprintf(stderr, "fatal: remote compositor lacks wl_compositor, "
+			"wl_subcompositor or zwlr_layer_shell_v1\n");
+		exit(EXIT_FAILURE);
+	}
+	backend->started = true;
+
+	struct panel *panel;
+	wl_list_for_each(panel, &server->panels, link) {
+		panel_setup(panel);
+	}
+	if (wl_list_empty(&server->panels)) {
+		fprintf(stderr, "info: no remote outputs yet, waiting for one\n");
+	}
+}
+
+void
+panel_schedule_frame(struct server *server)
+{
+	struct panel *panel;
+	wl_list_for_each(panel, &server->panels, link) {
+		if (panel->wlr_output) {
+			wlr_output_schedule_frame(panel->wlr_output);
+		}
+	}
+}
+
+/* The panel hosting passthrough surfaces, see passthrough.c */
+struct panel *
+panel_primary(struct server *server)
+{
+	if (wl_list_empty(&server->panels)) {
+		return NULL;
+	}
+	struct panel *panel = wl_container_of(server->panels.next, panel, link);
+	return panel->main_surface ? panel : NULL;
+}
+
+void
+panel_finish(struct server *server)
+{
+	struct panel *panel, *tmp;
+	wl_list_for_each_safe(panel, tmp, &server->panels, link) {
+		panel_destroy(panel);
+	}
+}
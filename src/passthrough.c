@@ -0,0 +1,351 @@
+#include <drm_fourcc.h>
+#include <wlr/types/wlr_buffer.h>
+#include "panel.h"
+
+/*
+ * In passthrough mode each mapped plugin toplevel gets its own remote
+ * subsurface under main_surface and its shm buffers are handed to the remote
+ * compositor as they are, so the nested renderer does not have to composite
+ * them into child_surface. Anything which the remote compositor could not
+ * show exactly like the scene-graph would (subsurfaces, popups, buffer
+ * transforms, viewports or non-shm buffers) falls back to the scene.
+ *
+ * The remote subsurfaces only exist on the primary panel, so while there is
+ * more than one panel everything is composited.
+ */
+
+struct passthrough_buffer {
+	struct passthrough *passthrough;
+	struct wlr_buffer *wlr_buffer;
+	struct wl_buffer *wl_buffer;
+
+	/* Locked while the remote compositor may still read from it */
+	bool busy;
+
+	struct wl_listener destroy;
+	struct wl_list link; /* passthrough.buffers */
+};
+
+struct passthrough {
+	struct toplevel *toplevel;
+	struct panel *panel;
+
+	struct wl_surface *surface;
+	struct wl_subsurface *subsurface;
+	struct wl_callback *frame_callback;
+	struct wl_list buffers;
+
+	/* Content is currently forwarded rather than composited */
+	bool active;
+	int x, y;
+};
+
+static uint32_t
+shm_format_from_drm(uint32_t format)
+{
+	/* These two are the only wl_shm formats not matching their fourcc */
+	switch (format) {
+	case DRM_FORMAT_ARGB8888:
+		return WL_SHM_FORMAT_ARGB8888;
+	case DRM_FORMAT_XRGB8888:
+		return WL_SHM_FORMAT_XRGB8888;
+	default:
+		return format;
+	}
+}
+
+static void
+buffer_destroy(struct passthrough_buffer *buffer)
+{
+	if (buffer->busy) {
+		wlr_buffer_unlock(buffer->wlr_buffer);
+	}
+	wl_buffer_destroy(buffer->wl_buffer);
+	wl_list_remove(&buffer->destroy.link);
+	wl_list_remove(&buffer->link);
+	free(buffer);
+}
+
+static void
+handle_wlr_buffer_destroy(struct wl_listener *listener, void *data)
+{
+	struct passthrough_buffer *buffer = wl_container_of(listener, buffer, destroy);
+	buffer->busy = false;
+	buffer_destroy(buffer);
+}
+
+static void
+handle_wl_buffer_release(void *data, struct wl_buffer *wl_buffer)
+{
+	struct passthrough_buffer *buffer = data;
+	if (buffer->busy) {
+		buffer->busy = false;
+		wlr_buffer_unlock(buffer->wlr_buffer);
+	}
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+	.release = handle_wl_buffer_release,
+};
+
+static struct passthrough_buffer *
+buffer_get_or_create(struct passthrough *passthrough, struct wlr_buffer *wlr_buffer)
+{
+	struct passthrough_buffer *buffer;
+	wl_list_for_each(buffer, &passthrough->buffers, link) {
+		if (buffer->wlr_buffer == wlr_buffer) {
+			return buffer;
+		}
+	}
+
+	struct wlr_shm_attributes shm;
+	if (!wlr_buffer_get_shm(wlr_buffer, &shm)) {
+		return NULL;
+	}
+
+	struct backend *backend = passthrough->toplevel->server->backend;
+	int32_t size = shm.offset + shm.stride * shm.height;
+	struct wl_shm_pool *pool = wl_shm_create_pool(backend->shm, shm.fd, size);
+	struct wl_buffer *wl_buffer = wl_shm_pool_create_buffer(pool, shm.offset,
+		shm.width, shm.height, shm.stride, shm_format_from_drm(shm.format));
+	/* The remote buffer keeps the mapping alive */
+	wl_shm_pool_destroy(pool);
+
+	buffer = calloc(1, sizeof(*buffer));
+	if (!buffer) {
+		wl_buffer_destroy(wl_buffer);
+		return NULL;
+	}
+	buffer->passthrough = passthrough;
+	buffer->wlr_buffer = wlr_buffer;
+	buffer->wl_buffer = wl_buffer;
+	wl_buffer_add_listener(wl_buffer, &buffer_listener, buffer);
+	buffer->destroy.notify = handle_wlr_buffer_destroy;
+	wl_signal_add(&wlr_buffer->events.destroy, &buffer->destroy);
+	wl_list_insert(&passthrough->buffers, &buffer->link);
+	return buffer;
+}
+
+static bool
+can_passthrough(struct toplevel *toplevel)
+{
+	struct wlr_xdg_surface *xdg_surface = toplevel->xdg_toplevel->base;
+	struct wlr_surface_state *state = &xdg_surface->surface->current;
+	return state->buffer
+		&& wl_list_length(&toplevel->server->panels) == 1
+		&& state->transform == WL_OUTPUT_TRANSFORM_NORMAL
+		&& state->scale == 1
+		&& !state->viewport.has_src
+		&& !state->viewport.has_dst
+		&& wl_list_empty(&state->subsurfaces_above)
+		&& wl_list_empty(&state->subsurfaces_below)
+		&& wl_list_empty(&xdg_surface->popups);
+}
+
+static void
+frame_handle_done(void *data, struct wl_callback *callback, uint32_t t)
+{
+	struct passthrough *passthrough = data;
+	wl_callback_destroy(callback);
+	passthrough->frame_callback = NULL;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (toplevel_frame_done_allowed(passthrough->toplevel, &now)) {
+		wlr_surface_send_frame_done(passthrough->toplevel->xdg_toplevel->base->surface,
+			&now);
+	}
+}
+
+static const struct wl_callback_listener frame_listener = {
+	.done = frame_handle_done,
+};
+
+static void
+set_active(struct passthrough *passthrough, bool active)
+{
+	if (passthrough->active == active) {
+		return;
+	}
+	passthrough->active = active;
+	wlr_scene_node_set_enabled(&passthrough->toplevel->scene_tree->node, !active);
+	if (!active) {
+		/* Hand back to the scene-graph */
+		wl_surface_attach(passthrough->surface, NULL, 0, 0);
+		wl_surface_commit(passthrough->surface);
+	}
+}
+
+/* Hand the toplevel back to the scene-graph and empty its subsurface */
+void
+passthrough_deactivate(struct toplevel *toplevel)
+{
+	if (toplevel->passthrough) {
+		set_active(toplevel->passthrough, false);
+	}
+}
+
+void
+passthrough_commit(struct toplevel *toplevel)
+{
+	struct passthrough *passthrough = toplevel->passthrough;
+	/* Nothing is forwarded for a plugin hidden over its shm budget */
+	if (!passthrough || toplevel->rejected) {
+		return;
+	}
+	struct wlr_surface *surface = toplevel->xdg_toplevel->base->surface;
+	if (!(surface->current.committed & WLR_SURFACE_STATE_BUFFER)) {
+		/* Keep frame callbacks flowing for commits without new content */
+		goto frame;
+	}
+
+	struct passthrough_buffer *buffer = NULL;
+	if (can_passthrough(toplevel)) {
+		buffer = buffer_get_or_create(passthrough, surface->current.buffer);
+	}
+	if (!buffer) {
+		set_active(passthrough, false);
+		return;
+	}
+
+	if (!buffer->busy) {
+		buffer->busy = true;
+		wlr_buffer_lock(buffer->wlr_buffer);
+	}
+	wl_surface_attach(passthrough->surface, buffer->wl_buffer, 0, 0);
+
+	int nrects;
+	pixman_box32_t *rects = pixman_region32_rectangles(&surface->buffer_damage, &nrects);
+	for (int i = 0; i < nrects; i++) {
+		wl_surface_damage_buffer(passthrough->surface, rects[i].x1, rects[i].y1,
+			rects[i].x2 - rects[i].x1, rects[i].y2 - rects[i].y1);
+	}
+	set_active(passthrough, true);
+
+frame:
+	if (!passthrough->active) {
+		return;
+	}
+	if (!passthrough->frame_callback
+			&& !wl_list_empty(&surface->current.frame_callback_list)) {
+		passthrough->frame_callback = wl_surface_frame(passthrough->surface);
+		wl_callback_add_listener(passthrough->frame_callback, &frame_listener,
+			passthrough);
+	}
+	wl_surface_commit(passthrough->surface);
+}
+
+void
+passthrough_move(struct toplevel *toplevel)
+{
+	struct passthrough *passthrough = toplevel->passthrough;
+	if (!passthrough) {
+		return;
+	}
+	/* Placed like wlr_scene_xdg_surface_create() places the surface */
+	struct wlr_scene_node *node = &toplevel->scene_tree->node;
+	int x = node->x - toplevel->geometry.x;
+	int y = node->y - toplevel->geometry.y;
+	if (passthrough->x == x && passthrough->y == y) {
+		return;
+	}
+	passthrough->x = x;
+	passthrough->y = y;
+	wl_subsurface_set_position(passthrough->subsurface, x, y);
+
+	/*
+	 * Subsurface positions are only applied on the next parent commit. That
+	 * is left to render_panel_commit(), so the move is presented together
+	 * with the scene it belongs to.
+	 */
+	struct panel *panel = passthrough->panel;
+	panel->needs_commit = true;
+	if (panel->wlr_output && panel->wlr_output->enabled) {
+		wlr_output_schedule_frame(panel->wlr_output);
+	}
+}
+
+void
+passthrough_create(struct toplevel *toplevel)
+{
+	struct server *server = toplevel->server;
+	struct backend *backend = server->backend;
+	struct panel *panel = panel_primary(server);
+	if (!server->passthrough || !panel) {
+		return;
+	}
+
+	struct passthrough *passthrough = calloc(1, sizeof(*passthrough));
+	if (!passthrough) {
+		return;
+	}
+	passthrough->toplevel = toplevel;
+	passthrough->panel = panel;
+	wl_list_init(&passthrough->buffers);
+	passthrough->surface = wl_compositor_create_surface(backend->compositor);
+	passthrough->subsurface = wl_subcompositor_get_subsurface(backend->subcompositor,
+		passthrough->surface, panel->main_surface);
+	wl_subsurface_set_desync(passthrough->subsurface);
+
+	/* Let input fall through to child_surface where it is handled */
+	struct wl_region *region = wl_compositor_create_region(backend->compositor);
+	wl_surface_set_input_region(passthrough->surface, region);
+	wl_region_destroy(region);
+
+	passthrough->x = -1;
+	toplevel->passthrough = passthrough;
+	passthrough_move(toplevel);
+}
+
+void
+passthrough_destroy(struct toplevel *toplevel)
+{
+	struct passthrough *passthrough = toplevel->passthrough;
+	if (!passthrough) {
+		return;
+	}
+	set_active(passthrough, false);
+
+	struct passthrough_buffer *buffer, *tmp;
+	wl_list_for_each_safe(buffer, tmp, &passthrough->buffers, link) {
+		buffer_destroy(buffer);
+	}
+	if (passthrough->frame_callback) {
+		wl_callback_destroy(passthrough->frame_callback);
+	}
+	wl_subsurface_destroy(passthrough->subsurface);
+	wl_surface_destroy(passthrough->surface);
+	free(passthrough);
+	toplevel->passthrough = NULL;
+}
+
+/*
+ * Move the remote subsurfaces of a panel which is going away to the new
+ * primary panel. Called after the panel has been taken off server.panels.
+ */
+void
+passthrough_panel_destroyed(struct panel *panel)
+{
+	struct toplevel *toplevel;
+	wl_list_for_each(toplevel, &panel->server->toplevels, link) {
+		if (toplevel->passthrough && toplevel->passthrough->panel == panel) {
+			passthrough_destroy(toplevel);
+			passthrough_create(toplevel);
+		}
+	}
+}
+
+bool
+passthrough_surface_at(struct toplevel *toplevel, double lx, double ly,
+		struct wlr_surface **surface, double *sx, double *sy)
+{
+	struct passthrough *passthrough = toplevel->passthrough;
+	if (!passthrough || !passthrough->active) {
+		return false;
+	}
+	struct wlr_scene_node *node = &toplevel->scene_tree->node;
+	*surface = wlr_xdg_surface_surface_at(toplevel->xdg_toplevel->base,
+		lx - node->x + toplevel->geometry.x, ly - node->y + toplevel->geometry.y,
+		sx, sy);
+	return true;
+}
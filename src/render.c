@@ -1,35 +1,383 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include "panel.h"
 
-static struct wl_callback *frame_callback;
+/*
+ * The background of each panel's main_surface is only redrawn when something
+ * has changed, for example a configure event or a resize. When nothing
+ * changes, nothing is committed to the remote compositor.
+ *
+ * Once the nested output is enabled the background is drawn by the frame
+ * clock, in the same main_surface commit which applies the synchronized
+ * child_surface, see render_panel_commit(). Before that, and while the
+ * output is disabled, it is committed on its own.
+ */
+
+static void render(struct panel *panel);
+
+struct feedback {
+	struct server *server;
+	struct timespec render_time;
+};
+
+static void
+feedback_handle_sync_output(void *data, struct wp_presentation_feedback *feedback,
+		struct wl_output *output)
+{
+	/* no-op */
+}
+
+static void
+feedback_handle_presented(void *data, struct wp_presentation_feedback *wp_feedback,
+		uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec, uint32_t refresh,
+		uint32_t seq_hi, uint32_t seq_lo, uint32_t flags)
+{
+	struct feedback *feedback = data;
+	struct timespec when = {
+		.tv_sec = ((uint64_t)tv_sec_hi << 32) | tv_sec_lo,
+		.tv_nsec = tv_nsec,
+	};
+	if (stats_presentation_time(feedback->server, &when)) {
+		histogram_add(&feedback->server->stats.background_to_present,
+			&feedback->render_time, &when);
+	}
+	wp_presentation_feedback_destroy(wp_feedback);
+	free(feedback);
+}
+
+static void
+feedback_handle_discarded(void *data, struct wp_presentation_feedback *wp_feedback)
+{
+	wp_presentation_feedback_destroy(wp_feedback);
+	free(data);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+	.sync_output = feedback_handle_sync_output,
+	.presented = feedback_handle_presented,
+	.discarded = feedback_handle_discarded,
+};
+
+static void
+request_feedback(struct panel *panel)
+{
+	struct server *server = panel->server;
+	struct backend *backend = server->backend;
+	if (!backend->presentation) {
+		return;
+	}
+	struct feedback *feedback = calloc(1, sizeof(*feedback));
+	if (!feedback) {
+		return;
+	}
+	feedback->server = server;
+	clock_gettime(CLOCK_MONOTONIC, &feedback->render_time);
+	struct wp_presentation_feedback *wp_feedback =
+		wp_presentation_feedback(backend->presentation, panel->main_surface);
+	wp_presentation_feedback_add_listener(wp_feedback, &feedback_listener, feedback);
+}
 
 static void
 frame_handle_done(void *data, struct wl_callback *callback, uint32_t t)
 {
-	struct server *server = data;
+	struct panel *panel = data;
 	wl_callback_destroy(callback);
-	frame_callback = NULL;
-	render(server);
+	panel->background.frame_callback = NULL;
+
+	/* Do not request another frame callback unless we have work to do */
+	if (panel->background.needs_redraw) {
+		render(panel);
+	}
 }
 
 static const struct wl_callback_listener frame_listener = {
 	.done = frame_handle_done,
 };
 
+static int
+create_shm_file(size_t size)
+{
+	char name[64];
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	for (int retries = 100; retries > 0; retries--) {
+		snprintf(name, sizeof(name), "/carthusian-%ld-%ld", (long)getpid(),
+			ts.tv_nsec + retries);
+		int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd >= 0) {
+			shm_unlink(name);
+			if (ftruncate(fd, size) < 0) {
+				close(fd);
+				return -1;
+			}
+			return fd;
+		}
+		if (errno != EEXIST) {
+			break;
+		}
+	}
+	return -1;
+}
+
+static void
+buffer_handle_release(void *data, struct wl_buffer *wl_buffer)
+{
+	struct panel *panel = data;
+	if (panel && wl_buffer == panel->background.buffer) {
+		/* Kept around for re-use until the size or colour changes */
+		panel->background.busy = false;
+	} else {
+		/* Replaced while the remote compositor was still using it */
+		wl_buffer_destroy(wl_buffer);
+	}
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+	.release = buffer_handle_release,
+};
+
+/* Premultiplied channel from 0xRRGGBBAA */
+static uint32_t
+channel(uint32_t rgba, int shift)
+{
+	uint32_t alpha = rgba & 0xff;
+	return ((rgba >> shift) & 0xff) * alpha / 0xff;
+}
+
+static struct wl_buffer *
+create_single_pixel_buffer(struct backend *backend, uint32_t rgba)
+{
+	const uint32_t scale = UINT32_MAX / 0xff;
+	return wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(
+		backend->single_pixel_buffer_manager,
+		channel(rgba, 24) * scale, channel(rgba, 16) * scale,
+		channel(rgba, 8) * scale, (rgba & 0xff) * scale);
+}
+
+static struct wl_buffer *
+create_shm_buffer(struct backend *backend, int width, int height, uint32_t rgba)
+{
+	int stride = width * 4;
+	size_t size = (size_t)stride * height;
+	int fd = create_shm_file(size);
+	if (fd < 0) {
+		fprintf(stderr, "warn: cannot create background buffer\n");
+		return NULL;
+	}
+	uint32_t *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	uint32_t argb = (rgba & 0xff) << 24 | channel(rgba, 24) << 16
+		| channel(rgba, 16) << 8 | channel(rgba, 8);
+	for (size_t i = 0; i < size / 4; i++) {
+		data[i] = argb;
+	}
+	munmap(data, size);
+
+	struct wl_shm_pool *pool = wl_shm_create_pool(backend->shm, fd, size);
+	struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0, width, height,
+		stride, WL_SHM_FORMAT_ARGB8888);
+	wl_shm_pool_destroy(pool);
+	close(fd);
+	return buffer;
+}
+
+/*
+ * Without a GPU-drawn background, the background is a single-pixel buffer
+ * scaled with wp_viewporter or, failing that, an shm buffer which is only
+ * re-created when the size or colour changes.
+ */
+static void
+render_buffer(struct panel *panel)
+{
+	struct server *server = panel->server;
+	struct backend *backend = server->backend;
+	int width = panel->width;
+	int height = panel->height;
+	uint32_t color = server->background;
+
+	bool single_pixel = backend->single_pixel_buffer_manager && backend->viewporter;
+	bool stale = !panel->background.buffer || color != panel->background.color
+		|| (!single_pixel && (width != panel->background.width
+			|| height != panel->background.height));
+
+	if (stale) {
+		struct wl_buffer *buffer = single_pixel
+			? create_single_pixel_buffer(backend, color)
+			: create_shm_buffer(backend, width, height, color);
+		if (!buffer) {
+			return;
+		}
+		struct wl_buffer *old = panel->background.buffer;
+		if (old && !panel->background.busy) {
+			wl_buffer_destroy(old);
+		}
+		panel->background.buffer = buffer;
+		panel->background.busy = true;
+		wl_buffer_add_listener(buffer, &buffer_listener, panel);
+		wl_surface_attach(panel->main_surface, buffer, 0, 0);
+	}
+
+	if (single_pixel) {
+		if (!panel->background.viewport) {
+			panel->background.viewport = wp_viewporter_get_viewport(
+				backend->viewporter, panel->main_surface);
+		}
+		wp_viewport_set_destination(panel->background.viewport, width, height);
+	}
+	panel->background.color = color;
+	panel->background.width = width;
+	panel->background.height = height;
+	wl_surface_damage_buffer(panel->main_surface, 0, 0, INT32_MAX, INT32_MAX);
+}
+
 /* See wlroots/render/egl.c for smarter implementation */
-void
-render(struct server *server)
+static void
+render_egl(struct panel *panel)
 {
+	struct server *server = panel->server;
 	struct backend *backend = server->backend;
-	eglMakeCurrent(backend->egl.display, backend->egl.surface,
-		backend->egl.surface, backend->egl.context);
+
+	eglMakeCurrent(backend->egl.display, panel->egl.surface,
+		panel->egl.surface, backend->egl.context);
 
 	/* Set eglSwapInterval to zero to avoid eglSwapBuffers() blocking */
 	eglSwapInterval(backend->egl.display, 0);
 
-	glViewport(0, 0, server->width, server->height);
+	glViewport(0, 0, panel->width, panel->height);
+	uint32_t rgba = server->background;
+	glClearColor((rgba >> 24 & 0xff) / 255.0f, (rgba >> 16 & 0xff) / 255.0f,
+		(rgba >> 8 & 0xff) / 255.0f, (rgba & 0xff) / 255.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+}
+
+static void
+render(struct panel *panel)
+{
+	struct server *server = panel->server;
+	struct backend *backend = server->backend;
+	panel->background.needs_redraw = false;
+	panel->needs_commit = false;
+
+	/*
+	 * The frame callback is only used to throttle redraws which are
+	 * requested before the compositor is ready for the next frame.
+	 */
+	panel->background.frame_callback = wl_surface_frame(panel->main_surface);
+	wl_callback_add_listener(panel->background.frame_callback, &frame_listener,
+		panel);
+	request_feedback(panel);
 
-	frame_callback = wl_surface_frame(server->backend->main_surface);
-	wl_callback_add_listener(frame_callback, &frame_listener, server);
-	eglSwapBuffers(backend->egl.display, backend->egl.surface);
+	if (server->egl_background) {
+		render_egl(panel);
+		eglSwapBuffers(backend->egl.display, panel->egl.surface);
+	} else {
+		render_buffer(panel);
+		wl_surface_commit(panel->main_surface);
+	}
 	wl_display_flush(backend->remote_display);
 }
+
+/*
+ * Commit main_surface once for this frame, with the background if it needs
+ * redrawing. This also applies the nested output's last child_surface commit,
+ * so both are presented together.
+ */
+void
+render_panel_commit(struct panel *panel)
+{
+	struct server *server = panel->server;
+	struct backend *backend = server->backend;
+	bool redraw = panel->background.needs_redraw && panel->width && panel->height
+		&& !(server->egl_background && !panel->egl.surface);
+	trace_begin(TRACE_MAIN_SURFACE_COMMIT, redraw);
+	panel->needs_commit = false;
+	if (redraw) {
+		panel->background.needs_redraw = false;
+		request_feedback(panel);
+	}
+
+	if (redraw && server->egl_background) {
+		render_egl(panel);
+		/* Commits main_surface */
+		eglSwapBuffers(backend->egl.display, panel->egl.surface);
+	} else {
+		if (redraw) {
+			render_buffer(panel);
+		}
+		wl_surface_commit(panel->main_surface);
+	}
+	wl_display_flush(backend->remote_display);
+	trace_end(TRACE_MAIN_SURFACE_COMMIT);
+}
+
+void
+render_panel_schedule(struct panel *panel)
+{
+	panel->background.needs_redraw = true;
+	if (panel->wlr_output && panel->wlr_output->enabled) {
+		/* Drawn by render_panel_commit() on the next frame */
+		wlr_output_schedule_frame(panel->wlr_output);
+		return;
+	}
+	if (panel->background.frame_callback) {
+		/* Will be redrawn in frame_handle_done() */
+		return;
+	}
+	if (!panel->width || !panel->height
+			|| (panel->server->egl_background && !panel->egl.surface)) {
+		/* Not yet configured; the configure event will schedule a frame */
+		return;
+	}
+	render(panel);
+}
+
+void
+render_schedule(struct server *server)
+{
+	struct panel *panel;
+	wl_list_for_each(panel, &server->panels, link) {
+		render_panel_schedule(panel);
+	}
+}
+
+void
+render_panel_finish(struct panel *panel)
+{
+	struct backend *backend = panel->server->backend;
+	if (panel->background.frame_callback) {
+		wl_callback_destroy(panel->background.frame_callback);
+	}
+	if (panel->background.viewport) {
+		wp_viewport_destroy(panel->background.viewport);
+	}
+	if (panel->background.buffer) {
+		if (panel->background.busy) {
+			/* buffer_handle_release() destroys it once released */
+			wl_buffer_set_user_data(panel->background.buffer, NULL);
+		} else {
+			wl_buffer_destroy(panel->background.buffer);
+		}
+	}
+	if (panel->egl.surface) {
+		eglMakeCurrent(backend->egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+			EGL_NO_CONTEXT);
+		eglDestroySurface(backend->egl.display, panel->egl.surface);
+	}
+	if (panel->egl.window) {
+		wl_egl_window_destroy(panel->egl.window);
+	}
+}
+
+void
+render_set_background(struct server *server, uint32_t rgba)
+{
+	if (server->background == rgba) {
+		return;
+	}
+	server->background = rgba;
+	render_schedule(server);
+}
@@ -0,0 +1,362 @@
+#include <errno.h>
+#include <inttypes.h>
+#include "panel.h"
+
+/*
+ * The shm pools and buffers of each plugin client are accounted by watching
+ * its requests with a protocol logger, which sees the sizes, and the
+ * resources it creates, which tell when they go away. The budget is charged
+ * the full size of each pool, which the panel keeps mapped for as long as the
+ * pool or any buffer made from it lives. Buffers are slices of their pool,
+ * so their height * stride is only reported.
+ *
+ * A client whose pools add up to more than --shm-budget is
+ * warned about, hidden from the panel until it is back under budget, or
+ * disconnected, depending on the policy. There is no way to refuse a single
+ * wl_buffer without a protocol error, hence hiding the plugin instead.
+ */
+
+struct shm_client {
+	struct server *server;
+	struct wl_client *client;
+	pid_t pid;
+
+	uint64_t pool_bytes;
+	uint64_t buffer_bytes;
+	uint64_t peak_bytes;
+	bool over_budget;
+
+	/* Seen by the logger, taken by the resource created right after */
+	uint64_t pending_pool_bytes;
+	uint64_t pending_buffer_bytes;
+	struct shm_pool *pending_buffer_pool;
+
+	struct wl_listener resource_created;
+	struct wl_listener destroy;
+	struct wl_list link; /* shm_budget.clients */
+};
+
+/* A wl_shm_pool, referenced by its resource and each buffer made from it */
+struct shm_pool {
+	uint64_t bytes;
+	int refs;
+	struct wl_listener destroy;
+};
+
+/* A wl_buffer created from a pool */
+struct shm_buffer {
+	uint64_t bytes;
+	struct shm_pool *pool;
+	struct wl_listener destroy;
+};
+
+static void
+shm_client_handle_destroy(struct wl_listener *listener, void *data)
+{
+	struct shm_client *shm_client = wl_container_of(listener, shm_client, destroy);
+	wl_list_remove(&shm_client->resource_created.link);
+	wl_list_remove(&shm_client->destroy.link);
+	wl_list_remove(&shm_client->link);
+	free(shm_client);
+}
+
+static struct shm_client *
+shm_client_from_wl_client(struct wl_client *client)
+{
+	struct wl_listener *listener =
+		wl_client_get_destroy_listener(client, shm_client_handle_destroy);
+	if (!listener) {
+		return NULL;
+	}
+	struct shm_client *shm_client = wl_container_of(listener, shm_client, destroy);
+	return shm_client;
+}
+
+static void
+shm_client_update(struct shm_client *shm_client)
+{
+	struct shm_budget *budget = &shm_client->server->shm_budget;
+	uint64_t bytes = shm_client->pool_bytes;
+	if (bytes > shm_client->peak_bytes) {
+		shm_client->peak_bytes = bytes;
+	}
+	bool over_budget = budget->limit && bytes > budget->limit;
+	if (over_budget == shm_client->over_budget) {
+		return;
+	}
+	shm_client->over_budget = over_budget;
+	if (budget->policy == SHM_BUDGET_REJECT) {
+		/* Shown again as soon as memory is freed, without waiting for a commit */
+		xdg_shell_set_rejected(shm_client->server, shm_client->client, over_budget);
+	}
+	if (!over_budget) {
+		fprintf(stderr, "info: plugin (pid %d) is back within its shm budget\n",
+			(int)shm_client->pid);
+		return;
+	}
+	fprintf(stderr, "warn: plugin (pid %d) uses %" PRIu64 "KiB of shm, over the "
+		"budget of %" PRIu64 "KiB\n", (int)shm_client->pid, bytes / 1024,
+		budget->limit / 1024);
+	if (budget->policy == SHM_BUDGET_DISCONNECT) {
+		fprintf(stderr, "warn: disconnecting plugin (pid %d)\n",
+			(int)shm_client->pid);
+		wl_client_post_no_memory(shm_client->client);
+	}
+}
+
+/* Already gone when the whole client is being destroyed */
+static struct shm_client *
+shm_client_from_resource(struct wl_resource *resource)
+{
+	return shm_client_from_wl_client(wl_resource_get_client(resource));
+}
+
+static void
+shm_pool_unref(struct shm_pool *pool, struct shm_client *shm_client)
+{
+	if (--pool->refs > 0) {
+		return;
+	}
+	if (shm_client) {
+		shm_client->pool_bytes -= pool->bytes;
+		shm_client_update(shm_client);
+	}
+	free(pool);
+}
+
+static void
+shm_pool_handle_destroy(struct wl_listener *listener, void *data)
+{
+	struct shm_pool *pool = wl_container_of(listener, pool, destroy);
+	struct shm_client *shm_client = shm_client_from_resource(data);
+	if (shm_client && shm_client->pending_buffer_pool == pool) {
+		shm_client->pending_buffer_pool = NULL;
+	}
+	wl_list_remove(&pool->destroy.link);
+	shm_pool_unref(pool, shm_client);
+}
+
+static void
+shm_buffer_handle_destroy(struct wl_listener *listener, void *data)
+{
+	struct shm_buffer *buffer = wl_container_of(listener, buffer, destroy);
+	struct shm_client *shm_client = shm_client_from_resource(data);
+	if (shm_client) {
+		shm_client->buffer_bytes -= buffer->bytes;
+	}
+	wl_list_remove(&buffer->destroy.link);
+	shm_pool_unref(buffer->pool, shm_client);
+	free(buffer);
+}
+
+static void
+shm_pool_add(struct shm_client *shm_client, struct wl_resource *resource,
+		uint64_t bytes)
+{
+	struct shm_pool *pool = calloc(1, sizeof(*pool));
+	if (!pool) {
+		return;
+	}
+	pool->bytes = bytes;
+	pool->refs = 1;
+	pool->destroy.notify = shm_pool_handle_destroy;
+	wl_resource_add_destroy_listener(resource, &pool->destroy);
+	shm_client->pool_bytes += bytes;
+	shm_client_update(shm_client);
+}
+
+static void
+shm_buffer_add(struct shm_client *shm_client, struct wl_resource *resource,
+		uint64_t bytes, struct shm_pool *pool)
+{
+	struct shm_buffer *buffer = calloc(1, sizeof(*buffer));
+	if (!buffer) {
+		return;
+	}
+	buffer->bytes = bytes;
+	buffer->pool = pool;
+	pool->refs++;
+	buffer->destroy.notify = shm_buffer_handle_destroy;
+	wl_resource_add_destroy_listener(resource, &buffer->destroy);
+	shm_client->buffer_bytes += bytes;
+}
+
+static void
+shm_client_handle_resource_created(struct wl_listener *listener, void *data)
+{
+	struct shm_client *shm_client =
+		wl_container_of(listener, shm_client, resource_created);
+	struct wl_resource *resource = data;
+	const char *class = wl_resource_get_class(resource);
+
+	if (shm_client->pending_pool_bytes && !strcmp(class, wl_shm_pool_interface.name)) {
+		uint64_t bytes = shm_client->pending_pool_bytes;
+		shm_client->pending_pool_bytes = 0;
+		shm_pool_add(shm_client, resource, bytes);
+	} else if (shm_client->pending_buffer_pool
+			&& !strcmp(class, wl_buffer_interface.name)) {
+		struct shm_pool *pool = shm_client->pending_buffer_pool;
+		shm_client->pending_buffer_pool = NULL;
+		shm_buffer_add(shm_client, resource, shm_client->pending_buffer_bytes, pool);
+	}
+}
+
+static void
+handle_client_created(struct wl_listener *listener, void *data)
+{
+	struct shm_budget *budget = wl_container_of(listener, budget, client_created);
+	struct server *server = wl_container_of(budget, server, shm_budget);
+	struct wl_client *client = data;
+
+	struct shm_client *shm_client = calloc(1, sizeof(*shm_client));
+	if (!shm_client) {
+		return;
+	}
+	shm_client->server = server;
+	shm_client->client = client;
+	wl_client_get_credentials(client, &shm_client->pid, NULL, NULL);
+	shm_client->destroy.notify = shm_client_handle_destroy;
+	wl_client_add_destroy_listener(client, &shm_client->destroy);
+	shm_client->resource_created.notify = shm_client_handle_resource_created;
+	wl_client_add_resource_created_listener(client, &shm_client->resource_created);
+	wl_list_insert(budget->clients.prev, &shm_client->link);
+}
+
+/*
+ * Called for every request before it is dispatched, so only the interface
+ * name is looked at for anything but shm requests
+ */
+static void
+protocol_logger(void *data, enum wl_protocol_logger_type type,
+		const struct wl_protocol_logger_message *message)
+{
+	if (type != WL_PROTOCOL_LOGGER_REQUEST) {
+		return;
+	}
+	const char *class = wl_resource_get_class(message->resource);
+	bool is_shm = !strcmp(class, wl_shm_interface.name);
+	bool is_pool = !is_shm && !strcmp(class, wl_shm_pool_interface.name);
+	if (!is_shm && !is_pool) {
+		return;
+	}
+	struct shm_client *shm_client =
+		shm_client_from_wl_client(wl_resource_get_client(message->resource));
+	if (!shm_client) {
+		return;
+	}
+	const union wl_argument *args = message->arguments;
+	struct shm_pool *pool = NULL;
+	if (is_pool) {
+		struct wl_listener *listener = wl_resource_get_destroy_listener(
+			message->resource, shm_pool_handle_destroy);
+		if (!listener) {
+			return;
+		}
+		pool = wl_container_of(listener, pool, destroy);
+	}
+
+	if (is_shm && message->message_opcode == WL_SHM_CREATE_POOL) {
+		/* new_id, fd, size */
+		shm_client->pending_pool_bytes = args[2].i > 0 ? args[2].i : 0;
+	} else if (is_pool && message->message_opcode == WL_SHM_POOL_CREATE_BUFFER) {
+		/* new_id, offset, width, height, stride, format */
+		int32_t height = args[3].i, stride = args[4].i;
+		shm_client->pending_buffer_bytes =
+			height > 0 && stride > 0 ? (uint64_t)height * stride : 0;
+		shm_client->pending_buffer_pool = pool;
+	} else if (is_pool && message->message_opcode == WL_SHM_POOL_RESIZE) {
+		/* Pools can only grow */
+		if (args[0].i > 0 && (uint64_t)args[0].i > pool->bytes) {
+			shm_client->pool_bytes += args[0].i - pool->bytes;
+			pool->bytes = args[0].i;
+			shm_client_update(shm_client);
+		}
+	}
+}
+
+bool
+shm_client_over_budget(struct server *server, struct wl_client *client)
+{
+	if (server->shm_budget.policy != SHM_BUDGET_REJECT) {
+		return false;
+	}
+	struct shm_client *shm_client = shm_client_from_wl_client(client);
+	return shm_client && shm_client->over_budget;
+}
+
+/* @arg is the size with an optional K, M or G suffix, then ":policy" */
+bool
+shm_budget_parse(struct server *server, const char *arg)
+{
+	struct shm_budget *budget = &server->shm_budget;
+	char *end;
+	errno = 0;
+	unsigned long long limit = strtoull(arg, &end, 10);
+	if (errno || end == arg) {
+		return false;
+	}
+	switch (*end) {
+	case 'G':
+		limit *= 1024;
+		/* fallthrough */
+	case 'M':
+		limit *= 1024;
+		/* fallthrough */
+	case 'K':
+		limit *= 1024;
+		end++;
+		break;
+	}
+
+	budget->policy = SHM_BUDGET_WARN;
+	if (*end == ':') {
+		end++;
+		if (!strcmp(end, "warn")) {
+			budget->policy = SHM_BUDGET_WARN;
+		} else if (!strcmp(end, "reject")) {
+			budget->policy = SHM_BUDGET_REJECT;
+		} else if (!strcmp(end, "disconnect")) {
+			budget->policy = SHM_BUDGET_DISCONNECT;
+		} else {
+			return false;
+		}
+	} else if (*end) {
+		return false;
+	}
+	budget->limit = limit;
+	return true;
+}
+
+void
+shm_budget_dump(struct server *server, FILE *stream)
+{
+	uint64_t total = 0;
+	int i = 0;
+	struct shm_client *shm_client;
+	wl_list_for_each(shm_client, &server->shm_budget.clients, link) {
+		uint64_t bytes = shm_client->pool_bytes;
+		if (!shm_client->peak_bytes) {
+			continue;
+		}
+		fprintf(stream, "shm.%d.pid %d\n", i, (int)shm_client->pid);
+		fprintf(stream, "shm.%d.pool_bytes %" PRIu64 "\n", i, shm_client->pool_bytes);
+		fprintf(stream, "shm.%d.buffer_bytes %" PRIu64 "\n", i,
+			shm_client->buffer_bytes);
+		fprintf(stream, "shm.%d.peak_bytes %" PRIu64 "\n", i, shm_client->peak_bytes);
+		fprintf(stream, "shm.%d.over_budget %d\n", i, shm_client->over_budget);
+		total += bytes;
+		i++;
+	}
+	fprintf(stream, "shm.total_bytes %" PRIu64 "\n", total);
+}
+
+void
+shm_budget_init(struct server *server, struct wl_display *local_display)
+{
+	struct shm_budget *budget = &server->shm_budget;
+	wl_list_init(&budget->clients);
+	budget->client_created.notify = handle_client_created;
+	wl_display_add_client_created_listener(local_display, &budget->client_created);
+	budget->logger = wl_display_add_protocol_logger(local_display, protocol_logger,
+		server);
+}
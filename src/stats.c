@@ -0,0 +1,271 @@
+#include <inttypes.h>
+#include <signal.h>
+#include "panel.h"
+
+/*
+ * Timestamps are taken with CLOCK_MONOTONIC and compared with the remote
+ * compositor's presentation timestamps, which use the clock advertised by
+ * wp_presentation.clock_id. That is CLOCK_MONOTONIC on all compositors we
+ * care about; any other clock is converted, see stats_presentation_time().
+ */
+#define HISTOGRAM_BUCKET0_NSEC (125 * 1000)
+
+static uint64_t
+timespec_diff_nsec(const struct timespec *start, const struct timespec *end)
+{
+	int64_t nsec = (int64_t)(end->tv_sec - start->tv_sec) * 1000000000
+		+ (end->tv_nsec - start->tv_nsec);
+	return nsec < 0 ? 0 : (uint64_t)nsec;
+}
+
+void
+histogram_add(struct histogram *histogram, const struct timespec *start,
+		const struct timespec *end)
+{
+	uint64_t nsec = timespec_diff_nsec(start, end);
+	int bucket = 0;
+	for (uint64_t limit = HISTOGRAM_BUCKET0_NSEC;
+			nsec >= limit && bucket < HISTOGRAM_BUCKETS - 1; limit *= 2) {
+		bucket++;
+	}
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	histogram->sum_nsec += nsec;
+	if (nsec > histogram->max_nsec) {
+		histogram->max_nsec = nsec;
+	}
+}
+
+void
+stats_toplevel_commit(struct toplevel *toplevel)
+{
+	clock_gettime(CLOCK_MONOTONIC, &toplevel->timing.commit_time);
+	toplevel->timing.commit_pending = true;
+}
+
+void
+stats_scene_commit(struct panel *panel)
+{
+	struct stats *stats = &panel->server->stats;
+	clock_gettime(CLOCK_MONOTONIC, &panel->scene_commit_time);
+	panel->scene_commit_seq = panel->wlr_output->commit_seq;
+
+	if (!stats->first_commit_nsec) {
+		stats->first_commit_nsec =
+			timespec_diff_nsec(&stats->start_time, &panel->scene_commit_time);
+		fprintf(stderr, "info: first frame committed %.3fms after start\n",
+			stats->first_commit_nsec / 1e6);
+	}
+
+	/* With several panels, the first one to show a buffer is timed */
+	struct toplevel *toplevel;
+	wl_list_for_each(toplevel, &panel->server->toplevels, link) {
+		if (!toplevel->timing.commit_pending) {
+			continue;
+		}
+		toplevel->timing.commit_pending = false;
+		histogram_add(&toplevel->timing.commit_to_scene,
+			&toplevel->timing.commit_time, &panel->scene_commit_time);
+		toplevel->timing.in_flight = true;
+		toplevel->timing.in_flight_commit_time = toplevel->timing.commit_time;
+		toplevel->timing.commit_panel = panel;
+		toplevel->timing.commit_seq = panel->scene_commit_seq;
+	}
+}
+
+/*
+ * Bring a remote presentation timestamp onto CLOCK_MONOTONIC. Returns false
+ * if the remote clock is not known, in which case the sample is dropped.
+ */
+bool
+stats_presentation_time(struct server *server, struct timespec *when)
+{
+	int clock = server->backend->presentation_clock;
+	if (clock == CLOCK_MONOTONIC) {
+		return true;
+	}
+	struct timespec remote_now, now;
+	if (clock < 0 || clock_gettime(clock, &remote_now)) {
+		return false;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t nsec = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec
+		+ (int64_t)(when->tv_sec - remote_now.tv_sec) * 1000000000
+		+ (when->tv_nsec - remote_now.tv_nsec);
+	if (nsec < 0) {
+		return false;
+	}
+	when->tv_sec = nsec / 1000000000;
+	when->tv_nsec = nsec % 1000000000;
+	return true;
+}
+
+void
+stats_scene_present(struct panel *panel, uint32_t commit_seq,
+		const struct timespec *remote_when)
+{
+	struct stats *stats = &panel->server->stats;
+	struct timespec present = *remote_when;
+	const struct timespec *when = &present;
+	bool valid = stats_presentation_time(panel->server, &present);
+	if (valid && commit_seq == panel->scene_commit_seq) {
+		histogram_add(&stats->scene_to_present, &panel->scene_commit_time, when);
+	}
+	if (valid && !stats->first_present_nsec && stats->first_commit_nsec) {
+		/* The time to first frame, as seen on screen */
+		stats->first_present_nsec = timespec_diff_nsec(&stats->start_time, when);
+		fprintf(stderr, "info: first frame presented %.3fms after start\n",
+			stats->first_present_nsec / 1e6);
+	}
+
+	struct toplevel *toplevel;
+	wl_list_for_each(toplevel, &panel->server->toplevels, link) {
+		if (!toplevel->timing.in_flight || toplevel->timing.commit_panel != panel
+				|| (int32_t)(commit_seq - toplevel->timing.commit_seq) < 0) {
+			continue;
+		}
+		toplevel->timing.in_flight = false;
+		if (valid) {
+			histogram_add(&toplevel->timing.commit_to_present,
+				&toplevel->timing.in_flight_commit_time, when);
+		}
+	}
+}
+
+/* Commits in flight on a removed panel are never presented */
+void
+stats_panel_destroyed(struct panel *panel)
+{
+	struct toplevel *toplevel;
+	wl_list_for_each(toplevel, &panel->server->toplevels, link) {
+		if (toplevel->timing.commit_panel == panel) {
+			toplevel->timing.in_flight = false;
+			toplevel->timing.commit_panel = NULL;
+		}
+	}
+}
+
+/*
+ * Remote pointer events are timed from their arrival until wlr_seat has sent
+ * them to the focused plugin. Coalesced motion is timed from the first event.
+ */
+void
+stats_input_event(struct server *server)
+{
+	struct stats *stats = &server->stats;
+	if (!stats->input_pending) {
+		clock_gettime(CLOCK_MONOTONIC, &stats->input_time);
+		stats->input_pending = true;
+	}
+}
+
+void
+stats_input_delivered(struct server *server)
+{
+	struct stats *stats = &server->stats;
+	if (!stats->input_pending) {
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	histogram_add(&stats->input_to_seat, &stats->input_time, &now);
+	stats->input_pending = false;
+}
+
+void
+stats_input_discard(struct server *server)
+{
+	server->stats.input_pending = false;
+}
+
+static void
+histogram_dump(const char *name, struct histogram *histogram, FILE *stream)
+{
+	if (!histogram->count) {
+		return;
+	}
+	fprintf(stream, "%s.count %" PRIu64 "\n", name, histogram->count);
+	fprintf(stream, "%s.avg_us %" PRIu64 "\n", name,
+		histogram->sum_nsec / histogram->count / 1000);
+	fprintf(stream, "%s.max_us %" PRIu64 "\n", name, histogram->max_nsec / 1000);
+
+	uint64_t limit = HISTOGRAM_BUCKET0_NSEC;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++, limit *= 2) {
+		if (!histogram->buckets[i]) {
+			continue;
+		}
+		if (i == HISTOGRAM_BUCKETS - 1) {
+			fprintf(stream, "%s.bucket.inf %" PRIu64 "\n", name,
+				histogram->buckets[i]);
+		} else {
+			fprintf(stream, "%s.bucket.lt_%" PRIu64 "us %" PRIu64 "\n", name,
+				limit / 1000, histogram->buckets[i]);
+		}
+	}
+}
+
+static int
+handle_sigusr1(int signal, void *data)
+{
+	struct server *server = data;
+	stats_dump(server, stderr);
+	return 0;
+}
+
+void
+stats_dump(struct server *server, FILE *stream)
+{
+	struct stats *stats = &server->stats;
+	uint64_t frames = stats->output_commits + stats->output_commits_skipped;
+
+	fprintf(stream, "startup.first_commit_us %" PRIu64 "\n",
+		stats->first_commit_nsec / 1000);
+	fprintf(stream, "startup.first_present_us %" PRIu64 "\n",
+		stats->first_present_nsec / 1000);
+	fprintf(stream, "output.frames %" PRIu64 "\n", frames);
+	fprintf(stream, "output.commits %" PRIu64 "\n", stats->output_commits);
+	fprintf(stream, "output.commits_skipped %" PRIu64 "\n",
+		stats->output_commits_skipped);
+	histogram_dump("output.scene_to_present", &stats->scene_to_present, stream);
+	histogram_dump("background.render_to_present",
+		&stats->background_to_present, stream);
+	histogram_dump("input.event_to_seat", &stats->input_to_seat, stream);
+
+	int i = 0;
+	struct toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->toplevels, link) {
+		fprintf(stream, "plugin.%d.app_id %s\n", i, toplevel_app_id(toplevel));
+
+		char name[64];
+		snprintf(name, sizeof(name), "plugin.%d.commit_to_scene", i);
+		histogram_dump(name, &toplevel->timing.commit_to_scene, stream);
+		snprintf(name, sizeof(name), "plugin.%d.commit_to_present", i);
+		histogram_dump(name, &toplevel->timing.commit_to_present, stream);
+
+		fprintf(stream, "plugin.%d.commits %" PRIu64 "\n", i, toplevel->rate.commits);
+		fprintf(stream, "plugin.%d.frame_requests %" PRIu64 "\n", i,
+			toplevel->rate.frame_requests);
+		fprintf(stream, "plugin.%d.pid %d\n", i, (int)toplevel->rate.pid);
+		fprintf(stream, "plugin.%d.commit_rate %d\n", i, toplevel_commit_rate(toplevel));
+		fprintf(stream, "plugin.%d.peak_commit_rate %d\n", i, toplevel->rate.peak_rate);
+		fprintf(stream, "plugin.%d.seconds_over_rate_limit %" PRIu64 "\n", i,
+			toplevel->rate.windows_over_limit);
+		fprintf(stream, "plugin.%d.frames_delayed %" PRIu64 "\n", i,
+			toplevel->rate.frames_delayed);
+		i++;
+	}
+	supervisor_dump(server, stream);
+	shm_budget_dump(server, stream);
+	fflush(stream);
+}
+
+/*
+ * Statistics are written to stderr on SIGUSR1, for example:
+ *
+ *     pkill -USR1 carthusian
+ */
+void
+stats_init(struct server *server, struct wl_event_loop *event_loop)
+{
+	wl_event_loop_add_signal(event_loop, SIGUSR1, handle_sigusr1, server);
+}
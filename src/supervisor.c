@@ -0,0 +1,416 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include "panel.h"
+
+/*
+ * The supervisor starts the plugin processes, reaps them when they exit and
+ * restarts them with exponential backoff. It also tracks when each plugin
+ * first maps a toplevel, which lets the panel hold back the first frame until
+ * the layout is complete or the startup deadline has passed.
+ */
+
+#define BACKOFF_INITIAL_MS (250)
+#define BACKOFF_MAX_MS (30 * 1000)
+
+/* A plugin which ran for this long is considered to have been healthy */
+#define HEALTHY_RUNTIME_MS (10 * 1000)
+
+extern char **environ;
+
+struct plugin_process {
+	struct server *server;
+	char *command;
+	char *buf;
+	char **argv;
+
+	pid_t pid;
+	struct timespec spawn_time;
+	bool mapped;
+	int64_t time_to_first_map_ms;
+	/* The last posix_spawnp() failed; retried with backoff */
+	bool spawn_failed;
+
+	int restarts;
+	int backoff_ms;
+	struct wl_event_source *restart_timer;
+	/* Removed at runtime, freed once it has exited */
+	bool removed;
+
+	struct wl_list link; /* supervisor.plugins */
+};
+
+static int64_t
+msec_since(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)(now.tv_sec - start->tv_sec) * 1000
+		+ (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Split on whitespace; quoting is not supported */
+static char **
+split_command(char *command)
+{
+	size_t n = 0;
+	char **argv = calloc(strlen(command) / 2 + 2, sizeof(*argv));
+	if (!argv) {
+		return NULL;
+	}
+	char *saveptr;
+	for (char *arg = strtok_r(command, " \t", &saveptr); arg;
+			arg = strtok_r(NULL, " \t", &saveptr)) {
+		argv[n++] = arg;
+	}
+	argv[n] = NULL;
+	return argv;
+}
+
+static void
+startup_complete(struct server *server)
+{
+	struct supervisor *supervisor = &server->supervisor;
+	if (supervisor->startup_complete) {
+		return;
+	}
+	supervisor->startup_complete = true;
+	if (supervisor->startup_deadline) {
+		wl_event_source_remove(supervisor->startup_deadline);
+		supervisor->startup_deadline = NULL;
+	}
+
+	int total = 0, mapped = 0;
+	struct plugin_process *plugin;
+	wl_list_for_each(plugin, &supervisor->plugins, link) {
+		total++;
+		mapped += plugin->mapped;
+	}
+	fprintf(stderr, "info: startup complete after %" PRId64 "ms with %d/%d plugins\n",
+		msec_since(&supervisor->start_time), mapped, total);
+
+	/* Present whatever has been laid out so far */
+	panel_schedule_frame(server);
+	input_replay_start(server);
+}
+
+static int
+handle_startup_deadline(void *data)
+{
+	struct server *server = data;
+	fprintf(stderr, "warn: startup deadline reached before all plugins mapped\n");
+	startup_complete(server);
+	return 0;
+}
+
+/* Startup waits for every plugin which could be started to map */
+static void
+startup_check(struct server *server)
+{
+	struct supervisor *supervisor = &server->supervisor;
+	if (!supervisor->startup_deadline) {
+		/* Not waiting yet, or no longer */
+		return;
+	}
+	struct plugin_process *plugin;
+	wl_list_for_each(plugin, &supervisor->plugins, link) {
+		if (!plugin->mapped && !plugin->removed && !plugin->spawn_failed) {
+			return;
+		}
+	}
+	startup_complete(server);
+}
+
+static void
+plugin_schedule_restart(struct plugin_process *plugin)
+{
+	fprintf(stderr, "info: restarting plugin '%s' in %dms\n", plugin->command,
+		plugin->backoff_ms);
+	wl_event_source_timer_update(plugin->restart_timer, plugin->backoff_ms);
+
+	/* The next failure waits twice as long unless this run is healthy */
+	plugin->backoff_ms *= 2;
+	if (plugin->backoff_ms > BACKOFF_MAX_MS) {
+		plugin->backoff_ms = BACKOFF_MAX_MS;
+	}
+}
+
+static bool
+plugin_spawn(struct plugin_process *plugin)
+{
+	/* The event loop blocks signals it handles, so unblock them in the child */
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &sigmask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+	clock_gettime(CLOCK_MONOTONIC, &plugin->spawn_time);
+	plugin->mapped = false;
+	int ret = posix_spawnp(&plugin->pid, plugin->argv[0], NULL, &attr,
+		plugin->argv, environ);
+	posix_spawnattr_destroy(&attr);
+	if (ret) {
+		fprintf(stderr, "warn: cannot start plugin '%s': %s\n", plugin->command,
+			strerror(ret));
+		plugin->pid = 0;
+		return false;
+	}
+	plugin->spawn_failed = false;
+	fprintf(stderr, "info: started plugin '%s' (pid %d)\n", plugin->command,
+		(int)plugin->pid);
+	return true;
+}
+
+/* A supervised plugin which could not be started is retried like a crash */
+static void
+plugin_start(struct plugin_process *plugin)
+{
+	if (plugin_spawn(plugin)) {
+		return;
+	}
+	/* Possibly transient, like EAGAIN or ENOMEM */
+	plugin->spawn_failed = true;
+	plugin_schedule_restart(plugin);
+	startup_check(plugin->server);
+}
+
+static int
+handle_restart_timer(void *data)
+{
+	struct plugin_process *plugin = data;
+	plugin->restarts++;
+	plugin_start(plugin);
+	return 0;
+}
+
+static void
+plugin_free(struct plugin_process *plugin)
+{
+	wl_event_source_remove(plugin->restart_timer);
+	wl_list_remove(&plugin->link);
+	free(plugin->argv);
+	free(plugin->buf);
+	free(plugin->command);
+	free(plugin);
+}
+
+static void
+plugin_exited(struct plugin_process *plugin, int status)
+{
+	int64_t runtime_ms = msec_since(&plugin->spawn_time);
+	plugin->pid = 0;
+
+	if (plugin->removed) {
+		fprintf(stderr, "info: removed plugin '%s' exited\n", plugin->command);
+		plugin_free(plugin);
+		return;
+	}
+
+	if (WIFSIGNALED(status)) {
+		fprintf(stderr, "warn: plugin '%s' killed by signal %d\n",
+			plugin->command, WTERMSIG(status));
+	} else if (WEXITSTATUS(status)) {
+		fprintf(stderr, "warn: plugin '%s' exited with status %d\n",
+			plugin->command, WEXITSTATUS(status));
+	} else {
+		/* A clean exit is the plugin's own choice, so leave it be */
+		fprintf(stderr, "info: plugin '%s' exited\n", plugin->command);
+		return;
+	}
+
+	if (runtime_ms >= HEALTHY_RUNTIME_MS) {
+		plugin->backoff_ms = BACKOFF_INITIAL_MS;
+	}
+	plugin_schedule_restart(plugin);
+}
+
+static int
+handle_sigchld(int signal, void *data)
+{
+	struct server *server = data;
+	pid_t pid;
+	int status;
+
+	/* Signals coalesce, so reap everything which has exited */
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		struct plugin_process *plugin;
+		wl_list_for_each(plugin, &server->supervisor.plugins, link) {
+			if (plugin->pid == pid) {
+				plugin_exited(plugin, status);
+				break;
+			}
+		}
+	}
+	return 0;
+}
+
+static struct plugin_process *
+plugin_create(struct server *server, const char *command)
+{
+	struct plugin_process *plugin = calloc(1, sizeof(*plugin));
+	if (!plugin) {
+		return NULL;
+	}
+	plugin->server = server;
+	plugin->command = strdup(command);
+	plugin->buf = strdup(command);
+	if (!plugin->command || !plugin->buf
+			|| !(plugin->argv = split_command(plugin->buf)) || !plugin->argv[0]) {
+		fprintf(stderr, "warn: invalid plugin command '%s'\n", command);
+		free(plugin->argv);
+		free(plugin->buf);
+		free(plugin->command);
+		free(plugin);
+		return NULL;
+	}
+	plugin->backoff_ms = BACKOFF_INITIAL_MS;
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(server->frontend->local_display);
+	plugin->restart_timer = wl_event_loop_add_timer(loop, handle_restart_timer, plugin);
+	wl_list_insert(server->supervisor.plugins.prev, &plugin->link);
+	return plugin;
+}
+
+void
+supervisor_add(struct server *server, const char *command)
+{
+	plugin_create(server, command);
+}
+
+/* Add a plugin once the panel is running, see control.c */
+bool
+supervisor_launch(struct server *server, const char *command)
+{
+	struct plugin_process *plugin = plugin_create(server, command);
+	if (!plugin) {
+		return false;
+	}
+	if (!plugin_spawn(plugin)) {
+		/* Not worth supervising if it cannot be started at all */
+		plugin_free(plugin);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Stop supervising the plugin process with @pid and terminate it. Its
+ * toplevel goes away with the connection.
+ */
+bool
+supervisor_remove(struct server *server, pid_t pid)
+{
+	struct plugin_process *plugin;
+	wl_list_for_each(plugin, &server->supervisor.plugins, link) {
+		if (plugin->pid == pid && !plugin->removed) {
+			plugin->removed = true;
+			wl_event_source_timer_update(plugin->restart_timer, 0);
+			kill(plugin->pid, SIGTERM);
+			fprintf(stderr, "info: removing plugin '%s' (pid %d)\n",
+				plugin->command, (int)plugin->pid);
+			return true;
+		}
+	}
+	return false;
+}
+
+void
+supervisor_toplevel_mapped(struct server *server, struct wl_client *client)
+{
+	struct supervisor *supervisor = &server->supervisor;
+	pid_t pid;
+	wl_client_get_credentials(client, &pid, NULL, NULL);
+
+	struct plugin_process *plugin;
+	wl_list_for_each(plugin, &supervisor->plugins, link) {
+		if (plugin->pid == pid && !plugin->mapped) {
+			plugin->mapped = true;
+			plugin->time_to_first_map_ms = msec_since(&plugin->spawn_time);
+			fprintf(stderr, "info: plugin '%s' mapped after %" PRId64 "ms\n",
+				plugin->command, plugin->time_to_first_map_ms);
+		}
+	}
+	startup_check(server);
+}
+
+void
+supervisor_dump(struct server *server, FILE *stream)
+{
+	int i = 0;
+	struct plugin_process *plugin;
+	wl_list_for_each(plugin, &server->supervisor.plugins, link) {
+		fprintf(stream, "process.%d.command %s\n", i, plugin->command);
+		fprintf(stream, "process.%d.pid %d\n", i, (int)plugin->pid);
+		fprintf(stream, "process.%d.restarts %d\n", i, plugin->restarts);
+		if (plugin->mapped) {
+			fprintf(stream, "process.%d.time_to_first_map_ms %" PRId64 "\n", i,
+				plugin->time_to_first_map_ms);
+		}
+		i++;
+	}
+}
+
+/*
+ * Start all plugins at once; none of them waits for another. This is done as
+ * early as possible, before the remote side is set up: plugins connecting in
+ * the meantime are served once the event loop runs.
+ */
+void
+supervisor_start(struct server *server)
+{
+	struct supervisor *supervisor = &server->supervisor;
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(server->frontend->local_display);
+
+	clock_gettime(CLOCK_MONOTONIC, &supervisor->start_time);
+	supervisor->sigchld = wl_event_loop_add_signal(loop, SIGCHLD, handle_sigchld, server);
+
+	struct plugin_process *plugin;
+	wl_list_for_each(plugin, &supervisor->plugins, link) {
+		plugin_start(plugin);
+	}
+}
+
+/* Arm the startup deadline, which counts from supervisor_start() */
+void
+supervisor_wait(struct server *server, int startup_deadline_ms)
+{
+	struct supervisor *supervisor = &server->supervisor;
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(server->frontend->local_display);
+
+	if (wl_list_empty(&supervisor->plugins)) {
+		startup_complete(server);
+		return;
+	}
+	int64_t remaining_ms = startup_deadline_ms - msec_since(&supervisor->start_time);
+	supervisor->startup_deadline =
+		wl_event_loop_add_timer(loop, handle_startup_deadline, server);
+	/* 0 would disarm the timer */
+	wl_event_source_timer_update(supervisor->startup_deadline,
+		remaining_ms > 0 ? remaining_ms : 1);
+	/* Plugins which failed to start are not waited for */
+	startup_check(server);
+}
+
+void
+supervisor_init(struct server *server)
+{
+	wl_list_init(&server->supervisor.plugins);
+}
+
+void
+supervisor_finish(struct server *server)
+{
+	struct plugin_process *plugin, *tmp;
+	wl_list_for_each_safe(plugin, tmp, &server->supervisor.plugins, link) {
+		if (plugin->pid) {
+			kill(plugin->pid, SIGTERM);
+		}
+		plugin_free(plugin);
+	}
+}
@@ -0,0 +1,166 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include "panel.h"
+
+/*
+ * With --trace, events along the frame and input paths are written as fixed
+ * size records into a ring buffer, which keeps the most recent ones. On
+ * SIGUSR2 and on exit the ring is exported as Chrome trace event JSON, which
+ * both chrome://tracing and ui.perfetto.dev open:
+ *
+ *     carthusian --trace /tmp/panel.json
+ *     pkill -USR2 carthusian
+ *
+ * When tracing is off, every trace point costs one load and branch of
+ * trace_enabled, see panel.h.
+ */
+
+#define TRACE_DEFAULT_RECORDS (64 * 1024)
+
+struct trace_record {
+	uint64_t time_nsec;
+	uint32_t arg;
+	uint16_t event;
+	char phase;
+};
+
+static const char *const event_names[TRACE_EVENT_COUNT] = {
+	[TRACE_REMOTE_POINTER_ENTER] = "remote.pointer_enter",
+	[TRACE_REMOTE_POINTER_LEAVE] = "remote.pointer_leave",
+	[TRACE_REMOTE_POINTER_MOTION] = "remote.pointer_motion",
+	[TRACE_REMOTE_POINTER_BUTTON] = "remote.pointer_button",
+	[TRACE_REMOTE_POINTER_FRAME] = "remote.pointer_frame",
+	[TRACE_REMOTE_CONFIGURE] = "remote.configure",
+	[TRACE_REMOTE_FRAME_DONE] = "remote.frame_done",
+	[TRACE_REMOTE_PRESENTED] = "remote.presented",
+	[TRACE_INPUT_DELIVERED] = "input.delivered",
+	[TRACE_PLUGIN_COMMIT] = "plugin.commit",
+	[TRACE_PLUGIN_FRAME_DONE_DELAYED] = "plugin.frame_done_delayed",
+	[TRACE_NATIVE_DRAW] = "native.draw",
+	[TRACE_LAYOUT] = "layout",
+	[TRACE_TRANSACTION_BEGIN] = "transaction.begin",
+	[TRACE_TRANSACTION_END] = "transaction.end",
+	[TRACE_OUTPUT_FRAME] = "output.frame",
+	[TRACE_SCENE_COMMIT] = "output.scene_commit",
+	[TRACE_MAIN_SURFACE_COMMIT] = "panel.main_surface_commit",
+	[TRACE_FRAME_DONE] = "output.frame_done",
+};
+
+bool trace_enabled;
+
+static struct {
+	struct trace_record *records;
+	size_t capacity;
+	size_t next;
+	bool wrapped;
+	char *path;
+} ring;
+
+void
+trace_record(enum trace_event event, char phase, uint32_t arg)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	struct trace_record *record = &ring.records[ring.next];
+	record->time_nsec = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	record->arg = arg;
+	record->event = event;
+	record->phase = phase;
+	if (++ring.next == ring.capacity) {
+		ring.next = 0;
+		ring.wrapped = true;
+	}
+}
+
+/* @arg is the path optionally followed by ":records", for example "t.json:4096" */
+bool
+trace_open(const char *arg)
+{
+	ring.path = strdup(arg);
+	if (!ring.path) {
+		return false;
+	}
+	ring.capacity = TRACE_DEFAULT_RECORDS;
+	char *colon = strrchr(ring.path, ':');
+	if (colon) {
+		char *end;
+		long records = strtol(colon + 1, &end, 10);
+		if (!*end && records > 0) {
+			*colon = '\0';
+			ring.capacity = records;
+		}
+	}
+	ring.records = calloc(ring.capacity, sizeof(*ring.records));
+	if (!ring.records) {
+		fprintf(stderr, "fatal: cannot allocate %zu trace records\n", ring.capacity);
+		free(ring.path);
+		return false;
+	}
+	trace_enabled = true;
+	return true;
+}
+
+static void
+write_record(FILE *f, const struct trace_record *record, pid_t pid, bool first)
+{
+	fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%" PRIu64 ".%03u,"
+		"\"pid\":%d,\"tid\":%d", first ? "" : ",", event_names[record->event],
+		record->phase, record->time_nsec / 1000,
+		(unsigned)(record->time_nsec % 1000), (int)pid, (int)pid);
+	if (record->phase == 'i') {
+		fprintf(f, ",\"s\":\"t\"");
+	}
+	if (record->phase != 'E') {
+		fprintf(f, ",\"args\":{\"arg\":%" PRIu32 "}", record->arg);
+	}
+	fprintf(f, "}");
+}
+
+/* Write the records currently in the ring, oldest first */
+void
+trace_export(void)
+{
+	if (!trace_enabled) {
+		return;
+	}
+	FILE *f = fopen(ring.path, "w");
+	if (!f) {
+		fprintf(stderr, "warn: cannot open '%s': %s\n", ring.path, strerror(errno));
+		return;
+	}
+	pid_t pid = getpid();
+	size_t start = ring.wrapped ? ring.next : 0;
+	size_t count = ring.wrapped ? ring.capacity : ring.next;
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (size_t i = 0; i < count; i++) {
+		write_record(f, &ring.records[(start + i) % ring.capacity], pid, i == 0);
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+	fprintf(stderr, "info: wrote %zu trace events to '%s'\n", count, ring.path);
+}
+
+static int
+handle_sigusr2(int signal, void *data)
+{
+	trace_export();
+	return 0;
+}
+
+void
+trace_init(struct wl_event_loop *event_loop)
+{
+	if (trace_enabled) {
+		wl_event_loop_add_signal(event_loop, SIGUSR2, handle_sigusr2, NULL);
+	}
+}
+
+void
+trace_finish(void)
+{
+	trace_export();
+	trace_enabled = false;
+	free(ring.records);
+	free(ring.path);
+}
@@ -0,0 +1,178 @@
+#include "panel.h"
+
+/*
+ * When the panel height changes, every plugin is configured to the new height
+ * at once. Until all of them have acked and committed a buffer for it, or the
+ * timeout has passed, the nested outputs do not commit and passthrough
+ * buffers are not forwarded, so the remote compositor keeps showing the last
+ * complete layout. The reflow then reaches the screen as one frame instead of
+ * one per plugin.
+ *
+ * Plugins only get a height; they pick their own width and the layout packs
+ * them. Anything drawn taller than asked for is clipped.
+ */
+
+#define TRANSACTION_TIMEOUT_MS (250)
+
+/*
+ * wlr_scene_xdg_surface_create() puts the surface's subsurface tree first and
+ * popups after it
+ */
+static struct wlr_scene_node *
+toplevel_surface_tree(struct toplevel *toplevel)
+{
+	struct wlr_scene_node *node =
+		wl_container_of(toplevel->scene_tree->children.next, node, link);
+	return node;
+}
+
+/* Clip what is drawn outside the geometry and below the configured height */
+void
+transaction_clip(struct toplevel *toplevel)
+{
+	struct server *server = toplevel->server;
+	if (!toplevel->xdg_toplevel || !server->plugin_height
+			|| wl_list_empty(&toplevel->scene_tree->children)) {
+		return;
+	}
+	struct wlr_box clip = toplevel->geometry;
+	if (clip.height > server->plugin_height) {
+		clip.height = server->plugin_height;
+	}
+	wlr_scene_subsurface_tree_set_clip(toplevel_surface_tree(toplevel), &clip);
+}
+
+static void
+transaction_end(struct server *server)
+{
+	struct transaction *transaction = &server->transaction;
+	trace_instant(TRACE_TRANSACTION_END, server->plugin_height);
+	transaction->pending = false;
+	wl_event_source_timer_update(transaction->timeout, 0);
+
+	struct toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->toplevels, link) {
+		toplevel->transaction.pending = false;
+		transaction_clip(toplevel);
+		/* Forward what was held back */
+		passthrough_commit(toplevel);
+	}
+	panel_schedule_frame(server);
+}
+
+static int
+handle_transaction_timeout(void *data)
+{
+	struct server *server = data;
+	struct toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->toplevels, link) {
+		if (toplevel->transaction.pending) {
+			fprintf(stderr, "warn: plugin '%s' did not resize in time\n",
+				toplevel_app_id(toplevel));
+		}
+	}
+	transaction_end(server);
+	return 0;
+}
+
+static void
+transaction_check(struct server *server)
+{
+	struct toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->toplevels, link) {
+		if (toplevel->transaction.pending) {
+			return;
+		}
+	}
+	transaction_end(server);
+}
+
+/* Called on every commit of a plugin toplevel */
+void
+transaction_toplevel_commit(struct toplevel *toplevel)
+{
+	struct server *server = toplevel->server;
+	struct wlr_xdg_surface *xdg_surface = toplevel->xdg_toplevel->base;
+	if (!toplevel->transaction.pending) {
+		return;
+	}
+	/* Serials increase, so anything later also answers the transaction */
+	if ((int32_t)(xdg_surface->current.configure_serial
+			- toplevel->transaction.serial) >= 0) {
+		toplevel->transaction.pending = false;
+		transaction_check(server);
+	}
+}
+
+/* An unmapped toplevel is no longer waited for */
+void
+transaction_toplevel_unmap(struct toplevel *toplevel)
+{
+	if (!toplevel->transaction.pending) {
+		return;
+	}
+	toplevel->transaction.pending = false;
+	transaction_check(toplevel->server);
+}
+
+/* Initial size of a new toplevel, which does not join a transaction */
+void
+transaction_configure_new(struct toplevel *toplevel)
+{
+	struct server *server = toplevel->server;
+	if (server->plugin_height) {
+		wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, 0, server->plugin_height);
+	} else {
+		wlr_xdg_surface_schedule_configure(toplevel->xdg_toplevel->base);
+	}
+}
+
+/*
+ * Called when a panel has been resized. Plugins are sized for the lowest
+ * shown panel; a hidden panel's strip does not count.
+ */
+void
+transaction_panels_resized(struct server *server)
+{
+	struct transaction *transaction = &server->transaction;
+	int height = 0;
+	struct panel *panel;
+	wl_list_for_each(panel, &server->panels, link) {
+		if (panel->autohidden || !panel->height) {
+			continue;
+		}
+		int plugin_height = panel->height - 2 * MARGIN_HORIZONTAL;
+		if (!height || plugin_height < height) {
+			height = plugin_height;
+		}
+	}
+	if (height <= 0 || height == server->plugin_height) {
+		return;
+	}
+	server->plugin_height = height;
+
+	bool any = false;
+	struct toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->toplevels, link) {
+		if (!toplevel->xdg_toplevel) {
+			continue;
+		}
+		toplevel->transaction.serial =
+			wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, 0, height);
+		toplevel->transaction.pending = true;
+		any = true;
+	}
+	if (!any) {
+		return;
+	}
+	trace_instant(TRACE_TRANSACTION_BEGIN, height);
+	transaction->pending = true;
+	wl_event_source_timer_update(transaction->timeout, TRANSACTION_TIMEOUT_MS);
+}
+
+void
+transaction_init(struct server *server, struct wl_event_loop *event_loop)
+{
+	server->transaction.timeout =
+		wl_event_loop_add_timer(event_loop, handle_transaction_timeout, server);
+}
@@ -1,20 +1,172 @@
 #include "panel.h"
 
-#define XDG_SHELL_VERSION (3)
+/* Version 6 is needed for the suspended toplevel state */
+#define XDG_SHELL_VERSION (6)
 
-#define MARGIN_HORIZONTAL (3)
-#define MARGIN_VERTICAL (3)
-#define PADDING (3)
+/*
+ * Commits and frame requests are counted per plugin toplevel, over one second
+ * windows. With --max-commit-rate, frame_done is held back so that a plugin
+ * drawing on frame callbacks cannot commit more often than that. Its state is
+ * never dropped; it just gets to draw less often.
+ */
+#define RATE_WINDOW_NSEC (1000 * 1000 * 1000)
+
+static int64_t
+nsec_between(const struct timespec *start, const struct timespec *end)
+{
+	return (int64_t)(end->tv_sec - start->tv_sec) * 1000000000
+		+ (end->tv_nsec - start->tv_nsec);
+}
+
+/* Commits in the last complete window, 0 once the plugin has gone quiet */
+int
+toplevel_commit_rate(struct toplevel *toplevel)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t elapsed = nsec_between(&toplevel->rate.window_start, &now);
+	if (elapsed < RATE_WINDOW_NSEC) {
+		return toplevel->rate.last_window_commits;
+	}
+	return elapsed < 2 * RATE_WINDOW_NSEC ? toplevel->rate.window_commits : 0;
+}
+
+static void
+toplevel_account_commit(struct toplevel *toplevel, struct wlr_surface *surface)
+{
+	struct server *server = toplevel->server;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	toplevel->rate.commits++;
+	if (!wl_list_empty(&surface->current.frame_callback_list)) {
+		toplevel->rate.frame_requests++;
+	}
+	int64_t elapsed = nsec_between(&toplevel->rate.window_start, &now);
+	if (elapsed >= RATE_WINDOW_NSEC) {
+		/* A gap of more than a window means nothing was committed in it */
+		toplevel->rate.last_window_commits =
+			elapsed < 2 * RATE_WINDOW_NSEC ? toplevel->rate.window_commits : 0;
+		toplevel->rate.window_start = now;
+		toplevel->rate.window_commits = 0;
+	}
+	toplevel->rate.window_commits++;
+	if (toplevel->rate.window_commits > toplevel->rate.peak_rate) {
+		toplevel->rate.peak_rate = toplevel->rate.window_commits;
+	}
+
+	if (server->max_commit_rate > 0
+			&& toplevel->rate.window_commits == server->max_commit_rate + 1) {
+		if (!toplevel->rate.windows_over_limit) {
+			fprintf(stderr, "warn: plugin '%s' commits more than %d times a "
+				"second\n", toplevel_app_id(toplevel), server->max_commit_rate);
+		}
+		toplevel->rate.windows_over_limit++;
+	}
+}
 
 static void
-arrange_toplevels(struct server *server)
+send_surface_frame_done(struct wlr_surface *surface, int sx, int sy, void *data)
+{
+	wlr_surface_send_frame_done(surface, data);
+}
+
+static int
+handle_frame_timer(void *data)
+{
+	struct toplevel *toplevel = data;
+	toplevel->rate.frame_timer_armed = false;
+	clock_gettime(CLOCK_MONOTONIC, &toplevel->rate.last_frame_done);
+	wlr_xdg_surface_for_each_surface(toplevel->xdg_toplevel->base,
+		send_surface_frame_done, &toplevel->rate.last_frame_done);
+	return 0;
+}
+
+/*
+ * Whether frame_done can be sent to the surfaces of @toplevel at @now. If not,
+ * it is sent to all of them by a timer once it is due.
+ */
+bool
+toplevel_frame_done_allowed(struct toplevel *toplevel, const struct timespec *now)
+{
+	struct server *server = toplevel->server;
+	if (server->max_commit_rate <= 0 || !toplevel->xdg_toplevel) {
+		return true;
+	}
+	struct timespec *last = &toplevel->rate.last_frame_done;
+	/* Other surfaces of the same toplevel in the same frame */
+	if (last->tv_sec == now->tv_sec && last->tv_nsec == now->tv_nsec) {
+		return true;
+	}
+	int64_t interval = RATE_WINDOW_NSEC / server->max_commit_rate;
+	int64_t elapsed = nsec_between(last, now);
+	if (elapsed >= interval) {
+		*last = *now;
+		return true;
+	}
+
+	if (!toplevel->rate.frame_timer) {
+		struct wl_event_loop *loop =
+			wl_display_get_event_loop(server->frontend->local_display);
+		toplevel->rate.frame_timer =
+			wl_event_loop_add_timer(loop, handle_frame_timer, toplevel);
+		if (!toplevel->rate.frame_timer) {
+			return true;
+		}
+	}
+	/*
+	 * Every output frame until the timer fires ends up here, but it is one
+	 * frame_done being held back.
+	 */
+	if (!toplevel->rate.frame_timer_armed) {
+		/* Round up, 0 would disarm the timer */
+		wl_event_source_timer_update(toplevel->rate.frame_timer,
+			(interval - elapsed + 999999) / 1000000);
+		toplevel->rate.frame_timer_armed = true;
+		toplevel->rate.frames_delayed++;
+		trace_instant(TRACE_PLUGIN_FRAME_DONE_DELAYED, toplevel->rate.pid);
+	}
+	return false;
+}
+
+/* The plugin toplevel a node of the scene belongs to, if any */
+struct toplevel *
+toplevel_from_node(struct server *server, struct wlr_scene_node *node)
+{
+	while (node->parent && node->parent != &server->scene->tree) {
+		node = &node->parent->node;
+	}
+	return node->parent ? node->data : NULL;
+}
+
+/*
+ * Hide a plugin over its shm budget, see shm-budget.c. In passthrough mode
+ * its remote subsurface is emptied too. Once shown again, the scene has its
+ * last buffer until the next commit is forwarded.
+ */
+void
+toplevel_set_rejected(struct toplevel *toplevel, bool rejected)
+{
+	if (toplevel->rejected == rejected) {
+		return;
+	}
+	toplevel->rejected = rejected;
+	if (rejected) {
+		passthrough_deactivate(toplevel);
+	}
+	wlr_scene_node_set_enabled(&toplevel->scene_tree->node, !rejected);
+}
+
+/* Called when the shm budget state of @client changes */
+void
+xdg_shell_set_rejected(struct server *server, struct wl_client *client, bool rejected)
 {
 	struct toplevel *toplevel;
-	int y = MARGIN_HORIZONTAL;
-	int x = MARGIN_VERTICAL;
 	wl_list_for_each(toplevel, &server->toplevels, link) {
-		wlr_scene_node_set_position(&toplevel->scene_tree->node, x, y);
-		x += toplevel->pending.width + PADDING;
+		if (toplevel->xdg_toplevel
+				&& wl_resource_get_client(toplevel->xdg_toplevel->resource) == client) {
+			toplevel_set_rejected(toplevel, rejected);
+		}
 	}
 }
 
@@ -22,31 +174,61 @@ static void
 handle_xdg_toplevel_map(struct wl_listener *listener, void *data)
 {
 	struct toplevel *toplevel = wl_container_of(listener, toplevel, map);
-	wl_list_insert(toplevel->server->toplevels.prev, &toplevel->link);
 	wlr_xdg_toplevel_set_activated(toplevel->xdg_toplevel, true);
-	arrange_toplevels(toplevel->server);
+	if (toplevel->server->suspended) {
+		wlr_xdg_toplevel_set_suspended(toplevel->xdg_toplevel, true);
+	}
+	wlr_xdg_surface_get_geometry(toplevel->xdg_toplevel->base, &toplevel->geometry);
+	passthrough_create(toplevel);
+	toplevel_set_rejected(toplevel, shm_client_over_budget(toplevel->server,
+		wl_resource_get_client(toplevel->xdg_toplevel->resource)));
+	if (!ghost_claim(toplevel)) {
+		layout_add(toplevel);
+	}
+	supervisor_toplevel_mapped(toplevel->server,
+		wl_resource_get_client(toplevel->xdg_toplevel->resource));
 }
 
 static void
 handle_xdg_toplevel_unmap(struct wl_listener *listener, void *data)
 {
 	struct toplevel *toplevel = wl_container_of(listener, toplevel, unmap);
-	wl_list_remove(&toplevel->link);
-	arrange_toplevels(toplevel->server);
+	passthrough_destroy(toplevel);
+	/* Keep the slot for the plugin to come back to, see ghost.c */
+	if (!ghost_create(toplevel)) {
+		layout_remove(toplevel);
+	}
+	transaction_toplevel_unmap(toplevel);
 }
 
 static void
 handle_xdg_toplevel_commit(struct wl_listener *listener, void *data)
 {
 	struct toplevel *toplevel = wl_container_of(listener, toplevel, commit);
+	trace_instant(TRACE_PLUGIN_COMMIT, toplevel->rate.pid);
+	toplevel_account_commit(toplevel, toplevel->xdg_toplevel->base->surface);
 	if (toplevel->xdg_toplevel->base->initial_commit) {
-		wlr_xdg_surface_schedule_configure(toplevel->xdg_toplevel->base);
+		transaction_configure_new(toplevel);
+		return;
+	}
+	struct wlr_surface *surface = toplevel->xdg_toplevel->base->surface;
+	if (!surface->mapped) {
 		return;
 	}
-	wlr_xdg_surface_get_geometry(toplevel->xdg_toplevel->base, &toplevel->pending);
+	if (surface->current.committed & WLR_SURFACE_STATE_BUFFER) {
+		stats_toplevel_commit(toplevel);
+	}
+
+	/* Held back during a resize, see transaction.c */
+	if (!toplevel->server->transaction.pending) {
+		passthrough_commit(toplevel);
+	}
 
-	// TODO: do some updated-required logic here
-	arrange_toplevels(toplevel->server);
+	struct wlr_box geometry;
+	wlr_xdg_surface_get_geometry(toplevel->xdg_toplevel->base, &geometry);
+	layout_set_geometry(toplevel, &geometry);
+	transaction_clip(toplevel);
+	transaction_toplevel_commit(toplevel);
 }
 
 static void
@@ -57,6 +239,9 @@ handle_xdg_toplevel_destroy(struct wl_listener *listener, void *data)
 	wl_list_remove(&toplevel->unmap.link);
 	wl_list_remove(&toplevel->commit.link);
 	wl_list_remove(&toplevel->destroy.link);
+	if (toplevel->rate.frame_timer) {
+		wl_event_source_remove(toplevel->rate.frame_timer);
+	}
 	free(toplevel);
 }
 
@@ -73,6 +258,8 @@ handle_new_xdg_toplevel(struct wl_listener *listener, void *data)
 		xdg_toplevel->base);
 	toplevel->scene_tree->node.data = toplevel;
 	xdg_toplevel->base->data = toplevel->scene_tree;
+	wl_client_get_credentials(wl_resource_get_client(xdg_toplevel->resource),
+		&toplevel->rate.pid, NULL, NULL);
 
 	toplevel->map.notify = handle_xdg_toplevel_map;
 	wl_signal_add(&xdg_toplevel->base->surface->events.map, &toplevel->map);
@@ -83,6 +270,7 @@ handle_new_xdg_toplevel(struct wl_listener *listener, void *data)
 	toplevel->destroy.notify = handle_xdg_toplevel_destroy;
 	wl_signal_add(&xdg_toplevel->events.destroy, &toplevel->destroy);
 }
+
 void
 xdg_shell_init(struct server *server, struct wl_display *local_display)
 {
@@ -96,3 +284,14 @@ xdg_shell_init(struct server *server, struct wl_display *local_display)
 	wl_signal_add(&server->xdg_shell->events.new_toplevel, &server->new_xdg_toplevel);
 }
 
+/* Plugins which bound xdg_wm_base version 6 or later get the suspended state */
+void
+xdg_shell_set_suspended(struct server *server, bool suspended)
+{
+	struct toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->toplevels, link) {
+		if (toplevel->xdg_toplevel) {
+			wlr_xdg_toplevel_set_suspended(toplevel->xdg_toplevel, suspended);
+		}
+	}
+}